@@ -0,0 +1,434 @@
+#include "balance.h"
+#include "circuit.h"
+#include "resolver.h"
+#include "log.h"
+
+typedef struct hash_point_s hash_point_t;
+
+struct hash_point_s
+{
+    unsigned int hash;
+    int index;                  // in process->upstreams
+};
+
+struct balancer_s
+{
+    int policy;
+    unsigned int rr_next;
+    int *schedule;              // wrr: backend indexes of one round, in the smooth order
+    int schedule_len;
+    upstream_t **heap;          // lc: min heap by load
+    int heap_num;
+    hash_point_t *ring;         // hash: points sorted by hash
+    int ring_num;
+    unsigned int rand_state;    // p2c
+};
+
+static const char *g_balance_policy_names[] = { "rr", "wrr", "lc", "p2c", "hash" };
+
+// murmur3 finalizer
+static unsigned int _hash32( unsigned int h )
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static unsigned int _rand( balancer_t *balancer )
+{
+    unsigned int x = balancer->rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    balancer->rand_state = x;
+    return x;
+}
+
+// down, not resolved yet, or with an open circuit
+static int _unavailable( upstream_t *upstream )
+{
+    return upstream->down || !upstream->resolved || upstream->circuit == CIRCUIT_OPEN;
+}
+
+// sessions may be sent to it now
+static int _usable( worker_process_t *process, upstream_t *upstream )
+{
+    return !upstream->down && upstream->resolved && circuit_allow( process, upstream );
+}
+
+// load is sessions per weight, an unavailable backend is loaded most
+static int _less_loaded( upstream_t *a, upstream_t *b )
+{
+    if( _unavailable( a ) != _unavailable( b ) )
+        return _unavailable( b );
+    return (long)a->active_num * b->weight < (long)b->active_num * a->weight;
+}
+
+static void _heap_swap( balancer_t *balancer, int i, int j )
+{
+    upstream_t *tmp = balancer->heap[i];
+    balancer->heap[i] = balancer->heap[j];
+    balancer->heap[j] = tmp;
+    balancer->heap[i]->heap_index = i;
+    balancer->heap[j]->heap_index = j;
+}
+
+static void _heap_up( balancer_t *balancer, int i )
+{
+    while( i > 0 ){
+        int parent = (i - 1) / 2;
+        if( !_less_loaded( balancer->heap[i], balancer->heap[parent] ) )
+            break;
+        _heap_swap( balancer, i, parent );
+        i = parent;
+    }
+}
+
+static void _heap_down( balancer_t *balancer, int i )
+{
+    while(1){
+        int least = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if( left < balancer->heap_num && _less_loaded( balancer->heap[left], balancer->heap[least] ) )
+            least = left;
+        if( right < balancer->heap_num && _less_loaded( balancer->heap[right], balancer->heap[least] ) )
+            least = right;
+        if( least == i )
+            break;
+        _heap_swap( balancer, i, least );
+        i = least;
+    }
+}
+
+// smooth weighted round robin, precomputed for one round of sum(weight) picks
+static int _build_schedule( worker_process_t *process, balancer_t *balancer )
+{
+    int total = 0;
+    int i, k;
+    for( i = 0; i < process->upstream_num; i++ )
+        total += process->upstreams[i].weight;
+
+    int *current = (int *)calloc( process->upstream_num, sizeof(int) );
+    balancer->schedule = (int *)malloc( total * sizeof(int) );
+    if( current == NULL || balancer->schedule == NULL ){
+        free( current );
+        return -1;
+    }
+
+    for( k = 0; k < total; k++ ){
+        int best = -1;
+        for( i = 0; i < process->upstream_num; i++ ){
+            current[i] += process->upstreams[i].weight;
+            if( best < 0 || current[i] > current[best] )
+                best = i;
+        }
+        current[best] -= total;
+        balancer->schedule[k] = best;
+    }
+    balancer->schedule_len = total;
+
+    free( current );
+    return 0;
+}
+
+static int _build_heap( worker_process_t *process, balancer_t *balancer )
+{
+    int i;
+    balancer->heap = (upstream_t **)malloc( process->upstream_num * sizeof(upstream_t *) );
+    if( balancer->heap == NULL )
+        return -1;
+
+    for( i = 0; i < process->upstream_num; i++ ){
+        balancer->heap[i] = &process->upstreams[i];
+        balancer->heap[i]->heap_index = i;
+    }
+    balancer->heap_num = process->upstream_num;
+    return 0;
+}
+
+static int _cmp_hash_point( const void *a, const void *b )
+{
+    unsigned int ha = ((const hash_point_t *)a)->hash;
+    unsigned int hb = ((const hash_point_t *)b)->hash;
+    return ha < hb ? -1 : ha > hb;
+}
+
+// of the configured host and port, known before a name is resolved
+static unsigned int _hash_host( host_t *host )
+{
+    const unsigned char *p = (const unsigned char *)host->hostname;
+    unsigned int h = 2166136261u;
+    while( *p )
+        h = (h ^ *p++) * 16777619u;
+    return _hash32( h ^ (unsigned int)host->port );
+}
+
+// BALANCE_VNODES points per weight, placed by the configured backend only,
+// so the same backend set gives the same ring in every worker and after dns
+static int _build_ring( worker_process_t *process, balancer_t *balancer )
+{
+    int total = 0;
+    int i, v, k = 0;
+    for( i = 0; i < process->upstream_num; i++ )
+        total += process->upstreams[i].weight * BALANCE_VNODES;
+
+    balancer->ring = (hash_point_t *)malloc( total * sizeof(hash_point_t) );
+    if( balancer->ring == NULL )
+        return -1;
+
+    for( i = 0; i < process->upstream_num; i++ ){
+        upstream_t *upstream = &process->upstreams[i];
+        unsigned int seed = _hash_host( &upstream->host );
+        for( v = 0; v < upstream->weight * BALANCE_VNODES; v++, k++ ){
+            balancer->ring[k].hash = _hash32( seed ^ _hash32( v + 1 ) );
+            balancer->ring[k].index = i;
+        }
+    }
+    qsort( balancer->ring, total, sizeof(hash_point_t), _cmp_hash_point );
+    balancer->ring_num = total;
+    return 0;
+}
+
+static unsigned long _upstream_bit( upstream_t *upstream )
+{
+    return 1UL << (upstream->index % (sizeof(unsigned long) * 8));
+}
+
+// the backends of the tried bits are skipped as if unusable
+static upstream_t *_select_by_hash( worker_process_t *process, balancer_t *balancer, struct sockaddr_in *client, unsigned long tried )
+{
+    unsigned int key = _hash32( ntohl( client->sin_addr.s_addr ) );
+    int low = 0, high = balancer->ring_num;
+
+    // the first point at or after key, wrapped
+    while( low < high ){
+        int mid = low + (high - low) / 2;
+        if( balancer->ring[mid].hash < key )
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    // an unusable backend passes its clients to the next points only
+    int i;
+    for( i = 0; i < balancer->ring_num; i++, low++ ){
+        if( low == balancer->ring_num )
+            low = 0;
+        upstream_t *upstream = &process->upstreams[balancer->ring[low].index];
+        if( _usable( process, upstream ) && !(tried & _upstream_bit( upstream )) )
+            return upstream;
+    }
+    return NULL;
+}
+
+int init_balancer( worker_process_t *process )
+{
+    balancer_t *balancer = (balancer_t *)malloc( sizeof(balancer_t) );
+    if( balancer == NULL )
+        return -1;
+    memset( balancer, 0, sizeof(balancer_t) );
+    balancer->policy = process->config->balance_policy;
+    balancer->rand_state = _hash32( getpid() ) | 1;
+    // workers start their rounds at different backends
+    balancer->rr_next = process->worker_id;
+    process->balancer = balancer;
+
+    int ret = 0;
+    switch( balancer->policy ){
+        case BALANCE_WRR:
+            ret = _build_schedule( process, balancer );
+            break;
+        case BALANCE_LC:
+            ret = _build_heap( process, balancer );
+            break;
+        case BALANCE_HASH:
+            ret = _build_ring( process, balancer );
+            break;
+    }
+    if( ret < 0 ){
+        LOG_ERROR("init balancer %s failed", g_balance_policy_names[balancer->policy] );
+        return -1;
+    }
+
+    return 0;
+}
+
+void destroy_balancer( worker_process_t *process )
+{
+    balancer_t *balancer = process->balancer;
+    if( balancer == NULL )
+        return;
+
+    free( balancer->schedule );
+    free( balancer->heap );
+    free( balancer->ring );
+    free( balancer );
+    process->balancer = NULL;
+}
+
+// the backend of the policy, not counted yet
+static upstream_t *_pick_upstream( worker_process_t *process, struct sockaddr_in *client )
+{
+    balancer_t *balancer = process->balancer;
+    upstream_t *upstream = NULL;
+    int i;
+
+    switch( balancer->policy ){
+        case BALANCE_WRR:
+            // the next usable backend of the schedule
+            for( i = 0; i < balancer->schedule_len && upstream == NULL; i++ ){
+                upstream = &process->upstreams[balancer->schedule[balancer->rr_next++ % balancer->schedule_len]];
+                if( !_usable( process, upstream ) )
+                    upstream = NULL;
+            }
+            break;
+        case BALANCE_LC:
+            upstream = balancer->heap[0];
+            // a half open one out of trials, the least loaded of the rest
+            if( !_usable( process, upstream ) ){
+                upstream = NULL;
+                for( i = 0; i < process->upstream_num; i++ ){
+                    upstream_t *next = &process->upstreams[i];
+                    if( _usable( process, next ) && (upstream == NULL || _less_loaded( next, upstream )) )
+                        upstream = next;
+                }
+            }
+            break;
+        case BALANCE_P2C: {
+            int a = _rand( balancer ) % process->upstream_num;
+            int b = _rand( balancer ) % process->upstream_num;
+            if( a == b && process->upstream_num > 1 )
+                b = (a + 1) % process->upstream_num;
+            upstream = &process->upstreams[a];
+            if( _less_loaded( &process->upstreams[b], upstream ) )
+                upstream = &process->upstreams[b];
+            // both unusable, any usable one
+            for( i = 0; i < process->upstream_num && !_usable( process, upstream ); i++ )
+                upstream = &process->upstreams[(b + 1 + i) % process->upstream_num];
+            if( !_usable( process, upstream ) )
+                upstream = NULL;
+            break;
+        }
+        case BALANCE_HASH:
+            upstream = _select_by_hash( process, balancer, client, 0 );
+            break;
+        default:
+            for( i = 0; i < process->upstream_num && upstream == NULL; i++ ){
+                upstream = &process->upstreams[balancer->rr_next++ % process->upstream_num];
+                if( !_usable( process, upstream ) )
+                    upstream = NULL;
+            }
+            break;
+    }
+    return upstream;
+}
+
+// a usable backend out of the tried bits: the next one on the ring for hash,
+// else the least loaded. NULL when all were tried
+static upstream_t *_pick_untried( worker_process_t *process, struct sockaddr_in *client, unsigned long tried )
+{
+    balancer_t *balancer = process->balancer;
+    upstream_t *upstream = NULL;
+    int i;
+
+    if( balancer->policy == BALANCE_HASH )
+        return _select_by_hash( process, balancer, client, tried );
+
+    for( i = 0; i < process->upstream_num; i++ ){
+        upstream_t *next = &process->upstreams[i];
+        if( _usable( process, next ) && !(tried & _upstream_bit( next ))
+            && (upstream == NULL || _less_loaded( next, upstream )) )
+            upstream = next;
+    }
+    return upstream;
+}
+
+static void _count_selected( worker_process_t *process, upstream_t *upstream )
+{
+    balancer_t *balancer = process->balancer;
+
+    upstream->active_num++;
+    upstream->select_num++;
+    if( balancer->policy == BALANCE_LC )
+        _heap_down( balancer, upstream->heap_index );
+}
+
+upstream_t *select_upstream( worker_process_t *process, struct sockaddr_in *client )
+{
+    upstream_t *upstream = _pick_upstream( process, client );
+    if( upstream )
+        _count_selected( process, upstream );
+    return upstream;
+}
+
+void hold_upstream( worker_process_t *process, upstream_t *upstream )
+{
+    balancer_t *balancer = process->balancer;
+
+    upstream->active_num++;
+    if( balancer->policy == BALANCE_LC )
+        _heap_down( balancer, upstream->heap_index );
+}
+
+upstream_t *select_next_upstream( worker_process_t *process, session_t *session, struct sockaddr_in *addr )
+{
+    struct sockaddr_in *client = &session->client->peer_host.ipv4;
+    upstream_t *upstream = session->last_upstream;
+
+    if( upstream && resolver_addr( upstream, session->addr_index + 1, addr ) == 0 ){
+        session->addr_index++;
+        hold_upstream( process, upstream );
+        return upstream;
+    }
+
+    // hash and lc give a tried backend again, pick among the others then
+    upstream = _pick_upstream( process, client );
+    if( upstream && (session->tried_mask & _upstream_bit( upstream )) ){
+        upstream_t *untried = _pick_untried( process, client, session->tried_mask );
+        if( untried )
+            upstream = untried;
+    }
+    if( upstream == NULL )
+        return NULL;
+
+    _count_selected( process, upstream );
+
+    session->tried_mask |= _upstream_bit( upstream );
+    session->last_upstream = upstream;
+    session->addr_index = 0;
+    *addr = upstream->addr;
+    return upstream;
+}
+
+void release_upstream( worker_process_t *process, upstream_t *upstream )
+{
+    balancer_t *balancer = process->balancer;
+
+    upstream->active_num--;
+    if( balancer->policy == BALANCE_LC )
+        _heap_up( balancer, upstream->heap_index );
+}
+
+void update_balancer( worker_process_t *process, upstream_t *upstream )
+{
+    balancer_t *balancer = process->balancer;
+
+    if( balancer->policy == BALANCE_LC ){
+        _heap_up( balancer, upstream->heap_index );
+        _heap_down( balancer, upstream->heap_index );
+    }
+}
+
+int balance_policy_of_name( const char *name )
+{
+    int i;
+    for( i = BALANCE_RR; i <= BALANCE_HASH; i++ ){
+        if( strcmp( name, g_balance_policy_names[i] ) == 0 )
+            return i;
+    }
+    return -1;
+}
@@ -0,0 +1,32 @@
+#ifndef BALANCE_H_
+#define BALANCE_H_
+
+#include "server.h"
+
+#define BALANCE_VNODES 160          // consistent hash points per unit of weight
+
+// build the policy state for process->upstreams
+int init_balancer( worker_process_t *process );
+
+void destroy_balancer( worker_process_t *process );
+
+// pick the backend of a new session or udp flow from the client address,
+// and count it as active on it. NULL when all backends are down
+upstream_t *select_upstream( worker_process_t *process, struct sockaddr_in *client );
+
+// count one more active on a selected backend, for another connect attempt to it
+void hold_upstream( worker_process_t *process, upstream_t *upstream );
+
+// the target of the next connect attempt of the session: the next address of
+// the last backend, else a backend not tried yet, else any one. selected as above
+upstream_t *select_next_upstream( worker_process_t *process, session_t *session, struct sockaddr_in *addr );
+
+// the session of a selected backend is closed
+void release_upstream( worker_process_t *process, upstream_t *upstream );
+
+// the backend went up or down
+void update_balancer( worker_process_t *process, upstream_t *upstream );
+
+int balance_policy_of_name( const char *name );
+
+#endif /*BALANCE_H_*/
@@ -1,7 +1,14 @@
+#define _GNU_SOURCE
 #include "cb_method.h"
 #include "log.h"
 #include "tcp.h"
 #include "utils.h"
+#include "pipe.h"
+#include "upstream.h"
+#include "balance.h"
+#include "circuit.h"
+#include "sockopt.h"
+#include "stats.h"
 
 static int _test_tcp_connect_result( int fd )
 {
@@ -21,110 +28,257 @@ static int _test_tcp_connect_result( int fd )
     return err;
 }
 
-static int _connect_remote(worker_process_t* process, connection_t* client)
+// the remote is connected: relay the data of both directions
+static void _start_relay( worker_process_t *process, connection_t *remote )
 {
-    connection_t *remote = (connection_t*)malloc(sizeof(connection_t));
-    memset(remote, 0, sizeof(connection_t));
-
-    remote->session = client->session;
-    client->session->remote = remote;
+    connection_t *client = remote->session->client;
 
-    client->peer_conn = remote;
-    remote->peer_conn = client;
+    remote->session->stage = SERVER_DATA;
+    remote->session->last_data_stamp = get_sys_ms();
+    circuit_connect_done( process, remote, 0 );
+    count_connect( process, remote->session );
+
+    DEBUG_INFO("connect remote ok, fd:%d, local: %s:%d", remote->fd, 
+        get_local_host( remote )->hostname, get_local_host( remote )->port );
+
+    // the bytes sent in the SYN are in the remote's socket already
+    if( remote->syn_data_len > 0 ){
+        client->buf_head += remote->syn_data_len;
+        if( buf_data_length( client ) == 0 )
+            clean_recv_buf( process, client );
+    }
+    clean_recv_buf( process, remote );
 
-    client->session->stage = SERVER_CONNECT_REMOTE;
+    // without pipe, the direction falls back to buffered copy
+    if( process->config->relay_mode == RELAY_MODE_SPLICE ){
+        client->pipe = alloc_pipe( process );
+        remote->pipe = alloc_pipe( process );
+    }
 
-    struct sockaddr_in s_addr;
-    memset(&s_addr, 0, sizeof(struct sockaddr_in));    
-    s_addr.sin_family = AF_INET;    
-    inet_aton(process->config->target_host, &s_addr.sin_addr);
-    s_addr.sin_port = htons(process->config->target_port);
-    copy_sockaddr_to_host_t(&s_addr, &remote->peer_host);
-    DEBUG_INFO("%s %d", inet_ntoa(s_addr.sin_addr), ntohs(s_addr.sin_port));
+    // new sockets are writable, the first bytes of the client go out at
+    // the first EPOLLOUT of the remote
+    client->write = 1;
+    remote->write = 1;
+    update_relay_events( process, remote );
+    update_relay_events( process, client );
+}
 
-    int fd = remote->fd = socket(AF_INET, SOCK_STREAM, 0);
+// the attempt is over, err: the connect error, -1 given up.
+// it may have events left in this batch, freed after it
+static void _drop_attempt( worker_process_t *process, connection_t *remote, int err )
+{
+    session_t *session = remote->session;
+    int i;
 
-    if ( fd < 0) {
-        DEBUG_INFO("create remote socket error, fd:%d, %s:%d", fd, remote->peer_host.hostname, 
-            remote->peer_host.port );
-        return -1;
+    for( i = 0; i < session->attempt_num; i++ ){
+        if( session->attempts[i] == remote ){
+            session->attempts[i] = session->attempts[--session->attempt_num];
+            break;
+        }
     }
 
-    int value = process->config->reuseaddr ==1?1:0;
-    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *) &value, sizeof(int)) == -1){
-        DEBUG_INFO("set SO_REUSEADDR fail, fd:%d", fd );
+    if( err > 0 ){
+        process->connect_fail_num++;
+        STATS_ADD( process, connect_fail_num, 1 );
+        if( err == ETIMEDOUT )
+            process->connect_timeout_num++;
     }
+    circuit_connect_done( process, remote, err );
+    release_upstream( process, remote->upstream );
+
+    if( remote->fd > 0 )
+        close( remote->fd );
+    remote->fd = 0;
+    free_connection_later( process, remote );
+}
 
-    int flags = fcntl( fd, F_GETFL, 0);
-    if (flags < 0) {
-        DEBUG_INFO("%s: get socket flags errorfd:%d, %s:%d", fd, remote->peer_host.hostname, 
-            remote->peer_host.port );
+// -1 when no connection could be allocated, a failed connect is an attempt
+static int _start_attempt( worker_process_t *process, session_t *session, upstream_t *upstream, struct sockaddr_in *addr )
+{
+    connection_t *remote = (connection_t*)slab_alloc( &process->conn_pool );
+    if( remote == NULL ){
+        DEBUG_INFO("malloc remote connection error, fd:%d", session->client->fd );
+        release_upstream( process, upstream );
         return -1;
     }
+    memset(remote, 0, sizeof(connection_t));
 
-    if (fcntl( fd, F_SETFL, flags | O_NONBLOCK) < 0) {
-        DEBUG_INFO("%s: set remote socket nonblock error,fd:%d, %s:%d", fd, remote->peer_host.hostname, 
-            remote->peer_host.port );
-        return -1;
+    remote->session = session;
+    remote->peer_conn = session->client;
+    remote->upstream = upstream;
+    copy_sockaddr_to_host_t( addr, &remote->peer_host );
+    remote->connect_stamp = get_sys_ms();
+
+    session->attempts[session->attempt_num++] = remote;
+    session->attempt_total++;
+    session->attempt_stamp = remote->connect_stamp;
+    process->connect_attempt_num++;
+    circuit_connect_start( process, remote );
+
+    // only the first attempt carries the first bytes, a parallel one would
+    // deliver them to a second backend
+    int fd;
+    connection_t *client = session->client;
+    if( process->config->fastopen_connect && session->attempt_total == 1 && buf_data_length( client ) > 0 ){
+        struct iovec iov[2];
+        int sent = 0;
+        fd = open_upstream_socket_with_data( process, upstream, addr, iov, buf_data_iov( client, iov ), &sent );
+        remote->syn_data_len = sent;
+        if( sent > 0 ){
+            process->fastopen_num++;
+            process->fastopen_byte_num += sent;
+        }
+    }
+    else
+        fd = open_upstream_socket_to( process, upstream, addr );
+    if ( fd < 0) {
+        int err = errno ? errno : ECONNREFUSED;
+        DEBUG_INFO("connect remote error, %s:%d", remote->peer_host.hostname, remote->peer_host.port );
+        session->err = err;
+        _drop_attempt( process, remote, err );
+        return 0;
     }
 
     register_session_event( process->epoll_fd, remote, fd, EPOLLOUT|EPOLLIN|EPOLLHUP|EPOLLERR, connect_remote_host_complete_cb );
-    int ret = connect( fd, (struct sockaddr*) &s_addr, sizeof (struct sockaddr));
-    if (ret < 0) {
-        if (errno != EINPROGRESS) {
-            DEBUG_INFO("connect remote error, fd:%d, %s:%d", fd,  remote->peer_host.hostname, 
-                remote->peer_host.port );
-            DEBUG_INFO("%s %d", strerror(errno), errno);
-            return errno;
+    return 0;
+}
+
+// fail the attempts past their deadline, start the ones due: at once when
+// none is in flight, else staggered. -1 when none is left
+static int _schedule_attempts( worker_process_t *process, session_t *session )
+{
+    config_t *config = process->config;
+    long now = get_sys_ms();
+    int i;
+
+    for( i = session->attempt_num - 1; i >= 0; i-- ){
+        connection_t *remote = session->attempts[i];
+        if( now - remote->connect_stamp >= config->connect_attempt_ms ){
+            DEBUG_INFO("connect remote timeout, fd:%d, %s:%d", remote->fd, remote->peer_host.hostname, remote->peer_host.port );
+            session->err = ETIMEDOUT;
+            _drop_attempt( process, remote, ETIMEDOUT );
         }
     }
-    if( ret == 0 ){
-        DEBUG_INFO("quick connect remote ok, fd:%d, %s:%d", fd,  remote->peer_host.hostname, 
-            remote->peer_host.port );
+
+    while( session->attempt_total <= config->connect_retries && session->attempt_num < CONNECT_ATTEMPTS_MAX ){
+        if( session->attempt_num > 0 &&
+            (config->connect_stagger_ms == 0 || now - session->attempt_stamp < config->connect_stagger_ms) )
+            break;
+
+        struct sockaddr_in addr;
+        upstream_t *upstream = select_next_upstream( process, session, &addr );
+        if( upstream == NULL || _start_attempt( process, session, upstream, &addr ) < 0 )
+            break;
     }
 
+    if( session->attempt_num == 0 )
+        return -1;
+
+    long next = 0;
+    for( i = 0; i < session->attempt_num; i++ ){
+        long deadline = session->attempts[i]->connect_stamp + config->connect_attempt_ms;
+        if( next == 0 || deadline < next )
+            next = deadline;
+    }
+    if( session->attempt_total <= config->connect_retries && config->connect_stagger_ms > 0 &&
+        session->attempt_num < CONNECT_ATTEMPTS_MAX && session->attempt_stamp + config->connect_stagger_ms < next )
+        next = session->attempt_stamp + config->connect_stagger_ms;
+    timer_add( &process->timer_wheel, &session->connect_timer, next );
     return 0;
 }
 
-// connect remote host completed callback, then reply the result to client
-// only for ipv4
+static void _connect_timer_cb( timer_node_t *timer, void *arg )
+{
+    worker_process_t *process = (worker_process_t *)arg;
+    session_t *session = list_entry( timer, session_t, connect_timer );
+
+    if( _schedule_attempts( process, session ) < 0 ){
+        DEBUG_INFO("connect remote failed, fd:%d, attempts: %d", session->client->fd, session->attempt_total );
+        close_session( process, session );
+    }
+}
+
+void cancel_connect_attempts( worker_process_t *process, session_t *session )
+{
+    // the connect timeout of the session fails them, else the client has gone
+    int err = session->err == ETIMEDOUT ? ETIMEDOUT : -1;
+
+    while( session->attempt_num > 0 )
+        _drop_attempt( process, session->attempts[0], err );
+    timer_del( &process->timer_wheel, &session->connect_timer );
+}
+
+static int _connect_remote(worker_process_t* process, connection_t* client)
+{
+    session_t *session = client->session;
+    struct sockaddr_in addr;
+    upstream_t *upstream = select_next_upstream( process, session, &addr );
+    if( upstream == NULL ){
+        LOG_WARN("no backend available, fd:%d", client->fd );
+        return -1;
+    }
+
+    // a connected socket from the pool skips the handshake
+    connection_t *remote = take_upstream_connection( process, upstream );
+    if( remote ){
+        DEBUG_INFO("pooled remote connection, fd:%d, %s:%d", remote->fd, upstream->host.hostname, upstream->host.port );
+        remote->session = session;
+        session->remote = remote;
+        client->peer_conn = remote;
+        remote->peer_conn = client;
+        _start_relay( process, remote );
+        return 0;
+    }
+
+    session->stage = SERVER_CONNECT_REMOTE;
+    session->connect_timer.handler = _connect_timer_cb;
+    if( _start_attempt( process, session, upstream, &addr ) < 0 )
+        return -1;
+    return _schedule_attempts( process, session );
+}
+
+// an attempt completed: the first connected one is the remote and relays,
+// a failed one makes room for the next
 void connect_remote_host_complete_cb(  worker_process_t *process, int remote_fd, int events, void *arg)   
 {
     connection_t *remote = (connection_t*)arg;
-    connection_t *client = remote->session->client;
+    session_t *session = remote->session;
+    int i;
 
-    if( remote->session->stage != SERVER_CONNECT_REMOTE ){
-        close_session( process, remote->session);
+    if( session->stage != SERVER_CONNECT_REMOTE ){
+        close_session( process, session);
         return;
     }
 
     int error = _test_tcp_connect_result( remote_fd );
     if (error) {
+        DEBUG_INFO("connect remote error, fd:%d, %s:%d, %s", remote_fd, remote->peer_host.hostname,
+            remote->peer_host.port, strerror(error) );
+        session->err = error;
+        _drop_attempt( process, remote, error );
+        if( _schedule_attempts( process, session ) < 0 )
+            close_session( process, session );
         return;
     }
 
-    remote->session->stage = SERVER_DATA;
-
-    // connect successfully  
-    if( events & (EPOLLOUT) ){
-        
-        struct sockaddr_in local_addr; 
-        socklen_t len = sizeof(local_addr);
-        getsockname( remote_fd, (struct sockaddr*)&local_addr, &len);
-        
-        copy_sockaddr_to_host_t(&local_addr, &remote->local_host);
-        
-        DEBUG_INFO("connect remote ok, fd:%d, local: %s:%d", remote_fd, remote->local_host.hostname, remote->local_host.port );
-        clean_recv_buf( remote );
-        change_session_event( process->epoll_fd, remote, remote_fd, EPOLLOUT|EPOLLIN|EPOLLHUP|EPOLLERR| EPOLLET, tcp_data_transform_et_cb );
-
-        client->session->stage = SERVER_DATA;
-        change_session_event( process->epoll_fd, client, client->fd, EPOLLOUT|EPOLLIN|EPOLLHUP|EPOLLERR| EPOLLET, tcp_data_transform_et_cb );
+    if( !(events & EPOLLOUT) )
+        return;
 
+    // connect successfully, the others are given up
+    for( i = 0; i < session->attempt_num; i++ ){
+        if( session->attempts[i] == remote ){
+            session->attempts[i] = session->attempts[--session->attempt_num];
+            break;
+        }
     }
-
-    return; 
-
+    while( session->attempt_num > 0 )
+        _drop_attempt( process, session->attempts[0], -1 );
+    timer_del( &process->timer_wheel, &session->connect_timer );
+
+    session->err = 0;
+    session->remote = remote;
+    session->client->peer_conn = remote;
+    _start_relay( process, remote );
 }
 
 void accpect_data_cb (  worker_process_t *process, int client_fd, int events, void *arg)
@@ -137,8 +291,12 @@ void accpect_data_cb (  worker_process_t *process, int client_fd, int events, vo
         return;
     }
     
-    int len, err;
-    len = recv_data_until_length ( con, RECV_BUF_SIZE - con->data_length, &err);
+    int len;
+    len = recv_data_until_length ( process, con, RECV_BUF_SIZE - buf_data_length( con ) );
+    // read at accept and nothing came yet, wait for it
+    if( events == 0 && len == 0 && !con->eof )
+        return;
+
     if( con->eof ){
         //net disconnected. close session
         DEBUG_INFO("disconnected when recv negotiation, len: %d from %s:%d", len,
@@ -149,83 +307,122 @@ void accpect_data_cb (  worker_process_t *process, int client_fd, int events, vo
     }
 
     con->session->connect_stamp = get_sys_ms();
+    con->session->connect_us = get_current_us();
     int ret = _connect_remote(process, con);
     if(ret < 0){
         DEBUG_INFO("connect remote faild!");
         close_session( process, con->session );
+        return;
     }
 
+    // stop reading client until remote connected, the rest data stays in kernel.
+    // a pooled remote is connected already, and relaying
+    if( con->session->stage == SERVER_CONNECT_REMOTE )
+        change_session_event( process->epoll_fd, con, client_fd, EPOLLHUP|EPOLLERR, accpect_data_cb );
+
     return;
 }
 
-void accept_connect_cb( worker_process_t *process, int listen_fd, int events )    
-{    
+// accept one connection, return -1 when no more connections to accept
+static int _accept_one( worker_process_t *process, int listen_fd )
+{
     int fd;    
     struct sockaddr_in sin;    
     socklen_t len = sizeof(struct sockaddr_in);    
-    fd = accept(listen_fd, (struct sockaddr*)&sin, &len);
+
+    // nonblocking and close-on-exec in the same syscall
+    fd = accept4(listen_fd, (struct sockaddr*)&sin, &len, SOCK_NONBLOCK|SOCK_CLOEXEC);
     if(fd == -1)    
     {    
-        if(errno != EAGAIN && errno != EINTR)    
+        if( errno == EINTR || errno == ECONNABORTED )
+            return 0;
+        if(errno != EAGAIN)    
         {    
-            DEBUG_INFO("accept error:%s, listen_fd:%d, %s", listen_fd, strerror(errno) );    
+            LOG_WARN("accept error, listen_fd:%d, %s", listen_fd, strerror(errno) );    
         }  
-        return;    
+        return -1;    
     }
 
-    DEBUG_INFO("accept connection success %s:%d", inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
-
-    int flags = fcntl( fd, F_GETFL, 0);
-    if (flags < 0) {
-        DEBUG_INFO("get socket flags error,fd: %d, %s", fd, strerror(errno) );
-        close( fd );
-        return ;
-    }
-
-    // set nonblocking  
-    if( fcntl(fd, F_SETFL, flags|O_NONBLOCK) < 0){  
-        DEBUG_INFO("fcntl nonblocking error,fd: %d, %s", fd, strerror(errno) );
-        close(fd);
-        return;
-    }
-    
     session_t *session = create_session( process, fd );
     if( session == NULL ){
-        DEBUG_INFO("no memory,fd: %d", fd );
+        LOG_WARN("no memory,fd: %d", fd );
         close(fd);
-        return;
+        return 0;
     }
 
     process->session_num++;
+    STATS_ADD( process, accept_num, 1 );
+    STATS_ADD( process, session_num, 1 );
     list_add_tail(&session->list_node, &process->session_list_head);
     connection_t *con = session->client;
+    set_sock_profile( fd, process->config->client_sock_profile );
 
+    // local address is resolved only when needed, by get_local_host()
     copy_sockaddr_to_host_t( &sin, &con->peer_host );
 
-
-    len = sizeof(sin);
-    getsockname( fd, (struct sockaddr*)&sin, &len);
-    copy_sockaddr_to_host_t( &sin, &con->local_host );
-
     DEBUG_INFO("new connection, %s:%d, sessions: %d, stage:%d",  
         con->peer_host.hostname, con->peer_host.port, process->session_num, session->stage );
     
-    clean_recv_buf( con );
+    clean_recv_buf( process, con );
     session->stage = SERVER_ACCPECT;
     register_session_event( process->epoll_fd, con, fd, EPOLLIN|EPOLLHUP|EPOLLERR, accpect_data_cb );
-    return;
-     
+
+    // accepted with the first data by defer accept or fast open, no wait for EPOLLIN
+    if( process->config->defer_accept || process->config->fastopen_qlen )
+        accpect_data_cb( process, fd, 0, con );
+    return 0;
 }
 
-// while data from client or remote host, then transform to the orther peer
-void tcp_data_transform_et_cb(  worker_process_t *process, int fd, int events, void *arg)
+// accept until EAGAIN, or accept_budget connections, then leave the rest
+// to the next wakeup so that the established sessions are not starved
+void accept_connect_cb( worker_process_t *process, int listen_fd, int events )    
+{    
+    int i;
+    for( i = 0; i < process->config->accept_budget; i++ ){
+        if( _accept_one( process, listen_fd ) < 0 )
+            break;
+    }
+}
+
+// read while there is room for the peer, wait for writable only while data
+// for con is pending: a full side is not woken up by its reads, nor an idle
+// one by acks. data left after the relay loop means con's socket is full, its
+// acks will come; a newly armed EPOLLOUT reports a writable socket at once
+void update_relay_events( worker_process_t *process, connection_t *con )
+{
+    connection_t *peer = con->peer_conn;
+    int events = EPOLLHUP|EPOLLERR|EPOLLET;
+
+    if( !con->eof && !recv_buf_full( con ) )
+        events |= EPOLLIN;
+    if( pending_length( peer ) > 0 )
+        events |= EPOLLOUT;
+    change_session_event( process->epoll_fd, con, con->fd, events, tcp_data_transform_et_cb );
+}
+
+// a connection that read its budget in this wakeup waits for its next turn
+// in the ready queue, with the events not served yet. the edge is not lost
+static int _relay_out_of_budget( worker_process_t *process, connection_t *con, long recv_len, int events )
+{
+    int budget = process->config->relay_budget;
+    if( budget < 0 || recv_len < budget )
+        return 0;
+
+    con->ready_events |= events;
+    if( !con->ready ){
+        con->ready = 1;
+        list_add_tail( &con->ready_node, &process->ready_head );
+        process->relay_defer_num++;
+    }
+    return 1;
+}
+
+static void _relay( worker_process_t *process, connection_t *con, int fd, int events )
 {
-    connection_t *con = (connection_t*)arg;
     connection_t *peer = con->peer_conn;
-    int err = 0;
     int len = 0;
     int ret = 0;
-    long total_len = 0;
+    long recv_len = 0;
 
     if( con->session->stage != SERVER_DATA ){
         DEBUG_INFO("error stage: %d, fd:%d", con->session->stage, fd );
@@ -238,8 +435,8 @@ void tcp_data_transform_et_cb(  worker_process_t *process, int fd, int events, v
         up_direct = 1;
 
     if( con->closed ){
-        DEBUG_INFO("%s closed by %d, fd:%d, dlen:%d, slen:%d, ", 
-            up_direct?"client":"remote", con->session->closed_by, fd, con->data_length, con->sent_length);
+        DEBUG_INFO("%s closed by %d, fd:%d, head:%zu, tail:%zu, ", 
+            up_direct?"client":"remote", con->session->closed_by, fd, con->buf_head, con->buf_tail);
         return;
     }
     
@@ -248,10 +445,13 @@ void tcp_data_transform_et_cb(  worker_process_t *process, int fd, int events, v
         con->read = 1;
 
         for(;;){
+            if( _relay_out_of_budget( process, con, recv_len, EPOLLIN ) )
+                break;
+
             if( con->read ){
                 ret = recv_data(process, con, up_direct, &len);
-                if(len>0 && up_direct)
-                    total_len += len;
+                if( len > 0 )
+                    recv_len += len;
 
                 if( ret == TCP_ABORT )
                     break;
@@ -262,8 +462,6 @@ void tcp_data_transform_et_cb(  worker_process_t *process, int fd, int events, v
 
             if( peer->write ){
                 ret = send_data(process, con, up_direct ? 0 : 1, &len);
-                if(len>0 && up_direct ? 0 : 1)
-                    total_len += len;
 
                 if( ret == TCP_ABORT )
                     break;
@@ -280,10 +478,11 @@ void tcp_data_transform_et_cb(  worker_process_t *process, int fd, int events, v
         con->write = 1;
 
         for(;;){
+            if( _relay_out_of_budget( process, con, recv_len, EPOLLOUT ) )
+                break;
+
             if(con->write){
                 ret = send_data(process, peer, up_direct, &len );
-                if(len > 0 && up_direct)
-                    total_len += len;
 
                 if( ret == TCP_ABORT )
                     break;
@@ -294,8 +493,8 @@ void tcp_data_transform_et_cb(  worker_process_t *process, int fd, int events, v
 
             if(peer->read){
                 ret = recv_data(process, peer, up_direct ? 0 : 1, &len );
-                if(len > 0 && up_direct ? 0 : 1)
-                    total_len += len;
+                if( len > 0 )
+                    recv_len += len;
 
                 if( ret == TCP_ABORT )
                     break;
@@ -306,6 +505,35 @@ void tcp_data_transform_et_cb(  worker_process_t *process, int fd, int events, v
 
         }
     }
+}
 
+// while data from client or remote host, then transform to the orther peer
+void tcp_data_transform_et_cb(  worker_process_t *process, int fd, int events, void *arg)
+{
+    connection_t *con = (connection_t*)arg;
 
-}
\ No newline at end of file
+    _relay( process, con, fd, events );
+    if( !con->session->closed ){
+        update_relay_events( process, con );
+        update_relay_events( process, con->peer_conn );
+    }
+}
+
+// one more turn for each connection out of budget, in the order they ran out.
+// the ones out of budget again wait for the next round
+void run_ready_connections( worker_process_t *process )
+{
+    list_node round;
+    INIT_LIST_HEAD( &round );
+    while( !list_empty( &process->ready_head ) )
+        list_move_tail( process->ready_head.next, &round );
+
+    while( !list_empty( &round ) ){
+        connection_t *con = list_entry( round.next, connection_t, ready_node );
+        int events = con->ready_events;
+        list_del( &con->ready_node );
+        con->ready = 0;
+        con->ready_events = 0;
+        con->call_back( process, con->fd, events, con );
+    }
+}
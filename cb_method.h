@@ -2,8 +2,17 @@
 
 void connect_remote_host_complete_cb(  worker_process_t *process, int remote_fd, int events, void *arg);
 
+// close the remote connect attempts of a closing session
+void cancel_connect_attempts( worker_process_t *process, session_t *session );
+
 void accpect_data_cb (  worker_process_t *process, int client_fd, int events, void *arg);
 
 void accept_connect_cb( worker_process_t *process, int listen_fd, int events );
 
-void tcp_data_transform_et_cb(  worker_process_t *process, int fd, int events, void *arg);
\ No newline at end of file
+// epoll interest of a relaying connection by the state of both directions
+void update_relay_events( worker_process_t *process, connection_t *con );
+
+void tcp_data_transform_et_cb(  worker_process_t *process, int fd, int events, void *arg);
+
+// after the epoll batch: the relays cut by their budget go on
+void run_ready_connections( worker_process_t *process );
\ No newline at end of file
@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+#include "circuit.h"
+#include "upstream.h"
+#include "balance.h"
+#include "log.h"
+#include "utils.h"
+
+#define CIRCUIT_MAX_BACKOFF 4       // open time doubled up to 1 << 4 times
+
+static const char *g_circuit_names[] = { "closed", "open", "half open" };
+
+static void _circuit_set( worker_process_t *process, upstream_t *upstream, int state )
+{
+    upstream->circuit = state;
+    upstream->trial_num = 0;
+    upstream->trial_ok_num = 0;
+    update_balancer( process, upstream );
+}
+
+static void _circuit_open( worker_process_t *process, upstream_t *upstream )
+{
+    config_t *config = process->config;
+    int shift = upstream->reopen_num < CIRCUIT_MAX_BACKOFF ? upstream->reopen_num : CIRCUIT_MAX_BACKOFF;
+    long open_ms = (long)config->circuit_open_ms << shift;
+
+    LOG_WARN("worker %d, backend %s:%d circuit open for %ld ms, %s, failed in a row: %d, connect avg: %ld ms",
+        process->worker_id, upstream->host.hostname, upstream->host.port, open_ms,
+        g_circuit_names[upstream->circuit], upstream->connect_fail_num, upstream->connect_ms );
+
+    _circuit_set( process, upstream, CIRCUIT_OPEN );
+    upstream->open_num++;
+    // the pool sockets go with the sessions, and are not refilled until closed
+    drain_upstream_pool( process, upstream );
+    timer_add( &process->timer_wheel, &upstream->circuit_timer, get_sys_ms() + open_ms );
+}
+
+static void _circuit_timer_cb( timer_node_t *timer, void *arg )
+{
+    worker_process_t *process = (worker_process_t *)arg;
+    upstream_t *upstream = list_entry( timer, upstream_t, circuit_timer );
+
+    LOG_INFO("worker %d, backend %s:%d circuit half open", process->worker_id,
+        upstream->host.hostname, upstream->host.port );
+    _circuit_set( process, upstream, CIRCUIT_HALF_OPEN );
+}
+
+int circuit_allow( worker_process_t *process, upstream_t *upstream )
+{
+    if( upstream->circuit == CIRCUIT_CLOSED )
+        return 1;
+    if( upstream->circuit == CIRCUIT_HALF_OPEN )
+        return upstream->trial_num < process->config->circuit_trials;
+    return 0;
+}
+
+void circuit_connect_start( worker_process_t *process, connection_t *remote )
+{
+    upstream_t *upstream = remote->upstream;
+
+    remote->connecting = 1;
+    remote->trial = upstream->circuit == CIRCUIT_HALF_OPEN;
+    if( remote->trial )
+        upstream->trial_num++;
+}
+
+void circuit_connect_done( worker_process_t *process, connection_t *remote, int err )
+{
+    config_t *config = process->config;
+    upstream_t *upstream = remote->upstream;
+
+    if( !remote->connecting )
+        return;
+    remote->connecting = 0;
+    if( remote->trial && upstream->circuit == CIRCUIT_HALF_OPEN && upstream->trial_num > 0 )
+        upstream->trial_num--;
+
+    // out of local resources: nothing about the upstream
+    if( err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM )
+        return;
+
+    // given up, by the client or for a faster attempt: slow only when pending too long
+    long ms = get_sys_ms() - remote->connect_stamp;
+    int slow = config->circuit_slow_ms > 0 && ms > config->circuit_slow_ms;
+    if( err < 0 && !slow )
+        return;
+
+    int failed = err || slow;
+    if( !err )
+        upstream->connect_ms = upstream->connect_ms ? (upstream->connect_ms * 7 + ms) / 8 : ms;
+
+    if( failed )
+        upstream->connect_fail_num++;
+    else
+        upstream->connect_fail_num = 0;
+
+    if( !config->circuit_breaker )
+        return;
+
+    switch( upstream->circuit ){
+        case CIRCUIT_CLOSED:
+            if( upstream->connect_fail_num >= config->circuit_failures )
+                _circuit_open( process, upstream );
+            break;
+        case CIRCUIT_HALF_OPEN:
+            // connects started before the circuit opened tell nothing new
+            if( !remote->trial )
+                break;
+            if( failed ){
+                upstream->reopen_num++;
+                _circuit_open( process, upstream );
+            }
+            else if( ++upstream->trial_ok_num >= config->circuit_trials ){
+                LOG_WARN("worker %d, backend %s:%d circuit closed", process->worker_id,
+                    upstream->host.hostname, upstream->host.port );
+                upstream->reopen_num = 0;
+                _circuit_set( process, upstream, CIRCUIT_CLOSED );
+            }
+            break;
+    }
+}
+
+void circuit_connect_abort( worker_process_t *process, connection_t *remote )
+{
+    int err = remote->session->err;
+    circuit_connect_done( process, remote, err ? err : -1 );
+}
+
+void init_circuit_breaker( worker_process_t *process )
+{
+    int i;
+    for( i = 0; i < process->upstream_num; i++ )
+        process->upstreams[i].circuit_timer.handler = _circuit_timer_cb;
+}
+
+void destroy_circuit_breaker( worker_process_t *process )
+{
+    int i;
+    for( i = 0; i < process->upstream_num; i++ )
+        timer_del( &process->timer_wheel, &process->upstreams[i].circuit_timer );
+}
@@ -0,0 +1,26 @@
+#ifndef CIRCUIT_H_
+#define CIRCUIT_H_
+
+#include "server.h"
+
+// passive outlier detection: the session connects of an upstream open its
+// circuit after too many failed or slow ones in a row, then a few trial
+// connects of the half open circuit decide to close it or open it again
+
+void init_circuit_breaker( worker_process_t *process );
+
+void destroy_circuit_breaker( worker_process_t *process );
+
+// new sessions may be sent to the upstream
+int circuit_allow( worker_process_t *process, upstream_t *upstream );
+
+// remote->upstream is selected, its socket is connecting
+void circuit_connect_start( worker_process_t *process, connection_t *remote );
+
+// err: 0 connected, -1 given up, else the connect error
+void circuit_connect_done( worker_process_t *process, connection_t *remote, int err );
+
+// the session is closed while connecting, failed by session->err or given up without
+void circuit_connect_abort( worker_process_t *process, connection_t *remote );
+
+#endif /*CIRCUIT_H_*/
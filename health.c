@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+#include "health.h"
+#include "upstream.h"
+#include "balance.h"
+#include "log.h"
+#include "utils.h"
+
+static void _close_probe( worker_process_t *process, upstream_t *upstream )
+{
+    connection_t *probe = upstream->probe;
+
+    // reset instead of FIN, no TIME_WAIT left for every probe
+    struct linger ling = {1, 0};
+    setsockopt( probe->fd, SOL_SOCKET, SO_LINGER, (void*)&ling, sizeof(ling) );
+    close( probe->fd );
+    slab_free( &process->conn_pool, probe );
+    upstream->probe = NULL;
+}
+
+static void _health_result( worker_process_t *process, upstream_t *upstream, int ok )
+{
+    config_t *config = process->config;
+
+    if( ok ){
+        upstream->health_fail_num = 0;
+        upstream->health_ok_num++;
+        if( upstream->down && upstream->health_ok_num >= config->health_rise ){
+            LOG_WARN("worker %d, backend %s:%d up", process->worker_id, upstream->host.hostname, upstream->host.port );
+            upstream->down = 0;
+            update_balancer( process, upstream );
+        }
+        return;
+    }
+
+    upstream->health_ok_num = 0;
+    upstream->health_fail_num++;
+    if( !upstream->down && upstream->health_fail_num >= config->health_fall ){
+        LOG_WARN("worker %d, backend %s:%d down", process->worker_id, upstream->host.hostname, upstream->host.port );
+        upstream->down = 1;
+        update_balancer( process, upstream );
+        drain_upstream_pool( process, upstream );
+    }
+}
+
+static void _health_probe_cb( worker_process_t *process, int fd, int events, void *arg )
+{
+    connection_t *probe = (connection_t*)arg;
+    upstream_t *upstream = probe->upstream;
+    int err = 0;
+    socklen_t len = sizeof(int);
+
+    if( getsockopt( fd, SOL_SOCKET, SO_ERROR, (void *)&err, &len ) < 0 )
+        err = errno;
+    int ok = !err && (events & EPOLLOUT) && !(events & (EPOLLERR|EPOLLHUP));
+    DEBUG_INFO("health probe %s:%d %s, %ld ms", upstream->host.hostname, upstream->host.port,
+        ok ? "ok" : strerror(err), get_sys_ms() - upstream->probe_stamp );
+
+    _close_probe( process, upstream );
+    _health_result( process, upstream, ok );
+    timer_add( &process->timer_wheel, &upstream->health_timer, upstream->probe_stamp + process->config->health_interval );
+}
+
+// start a probe, or fail the one not connected in time
+static void _health_timer_cb( timer_node_t *timer, void *arg )
+{
+    worker_process_t *process = (worker_process_t *)arg;
+    config_t *config = process->config;
+    upstream_t *upstream = list_entry( timer, upstream_t, health_timer );
+
+    if( upstream->probe ){
+        DEBUG_INFO("health probe %s:%d timeout", upstream->host.hostname, upstream->host.port );
+        _close_probe( process, upstream );
+        _health_result( process, upstream, 0 );
+        timer_add( &process->timer_wheel, &upstream->health_timer, upstream->probe_stamp + config->health_interval );
+        return;
+    }
+
+    upstream->probe_stamp = get_sys_ms();
+    if( !upstream->resolved ){
+        timer_add( &process->timer_wheel, &upstream->health_timer, upstream->probe_stamp + config->health_interval );
+        return;
+    }
+
+    connection_t *probe = (connection_t*)slab_alloc( &process->conn_pool );
+    if( probe == NULL ){
+        timer_add( &process->timer_wheel, &upstream->health_timer, upstream->probe_stamp + config->health_interval );
+        return;
+    }
+    memset( probe, 0, sizeof(connection_t) );
+    probe->upstream = upstream;
+
+    probe->fd = open_upstream_socket( process, upstream );
+    if( probe->fd < 0 ){
+        slab_free( &process->conn_pool, probe );
+        _health_result( process, upstream, 0 );
+        timer_add( &process->timer_wheel, &upstream->health_timer, upstream->probe_stamp + config->health_interval );
+        return;
+    }
+
+    register_session_event( process->epoll_fd, probe, probe->fd, EPOLLOUT|EPOLLHUP|EPOLLERR, _health_probe_cb );
+    upstream->probe = probe;
+    timer_add( &process->timer_wheel, &upstream->health_timer, upstream->probe_stamp + config->health_timeout );
+}
+
+void init_health_check( worker_process_t *process )
+{
+    config_t *config = process->config;
+    int i;
+
+    // the probes need epoll, the io_uring backend goes without
+    if( !config->health_check || process->epoll_fd <= 0 )
+        return;
+
+    // spread the probes of the backends over the interval
+    for( i = 0; i < process->upstream_num; i++ ){
+        upstream_t *upstream = &process->upstreams[i];
+        upstream->health_timer.handler = _health_timer_cb;
+        timer_add( &process->timer_wheel, &upstream->health_timer,
+            get_sys_ms() + (long)config->health_interval * i / process->upstream_num );
+    }
+}
+
+void destroy_health_check( worker_process_t *process )
+{
+    int i;
+    for( i = 0; i < process->upstream_num; i++ ){
+        upstream_t *upstream = &process->upstreams[i];
+        if( upstream->probe )
+            _close_probe( process, upstream );
+        timer_del( &process->timer_wheel, &upstream->health_timer );
+    }
+}
@@ -0,0 +1,11 @@
+#ifndef HEALTH_H_
+#define HEALTH_H_
+
+#include "server.h"
+
+// probe every upstream with a tcp connect, on the worker's epoll loop
+void init_health_check( worker_process_t *process );
+
+void destroy_health_check( worker_process_t *process );
+
+#endif /*HEALTH_H_*/
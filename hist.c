@@ -0,0 +1,96 @@
+#include "hist.h"
+
+#define HIST_SUB_NUM (1UL << HIST_SUB_BITS)
+
+static int _hist_index( unsigned long value )
+{
+    if( value < HIST_SUB_NUM )
+        return value;
+
+    int msb = 63 - __builtin_clzl( value );
+    if( msb >= HIST_MAX_BITS )
+        return HIST_BUCKET_NUM - 1;
+    int shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((value >> shift) - HIST_SUB_NUM);
+}
+
+static unsigned long _hist_bucket_max( int index )
+{
+    int shift = (index >> HIST_SUB_BITS) - 1;
+    if( shift <= 0 )
+        return index;
+    return ((((unsigned long)index & (HIST_SUB_NUM - 1)) + HIST_SUB_NUM) << shift) + (1UL << shift) - 1;
+}
+
+// the only writer: plain load and store, never torn for the readers
+static void _hist_set( unsigned long *field, unsigned long value )
+{
+    __atomic_store_n( field, value, __ATOMIC_RELAXED );
+}
+
+void hist_record( hist_t *hist, unsigned long value )
+{
+    unsigned long *bucket = &hist->buckets[_hist_index( value )];
+    _hist_set( bucket, *bucket + 1 );
+    _hist_set( &hist->sum, hist->sum + value );
+    if( value > hist->max )
+        _hist_set( &hist->max, value );
+    _hist_set( &hist->count, hist->count + 1 );
+}
+
+void hist_merge( hist_t *dst, hist_t *src )
+{
+    unsigned long count = 0;
+    int i;
+    for( i = 0; i < HIST_BUCKET_NUM; i++ ){
+        unsigned long num = __atomic_load_n( &src->buckets[i], __ATOMIC_RELAXED );
+        dst->buckets[i] += num;
+        count += num;
+    }
+
+    // count of the buckets read, the ones recorded meanwhile may be missed
+    unsigned long max = __atomic_load_n( &src->max, __ATOMIC_RELAXED );
+    dst->count += count;
+    dst->sum += __atomic_load_n( &src->sum, __ATOMIC_RELAXED );
+    if( max > dst->max )
+        dst->max = max;
+}
+
+void hist_diff( hist_t *dst, hist_t *cur, hist_t *last )
+{
+    int i, top = -1;
+    for( i = 0; i < HIST_BUCKET_NUM; i++ ){
+        dst->buckets[i] = cur->buckets[i] - last->buckets[i];
+        if( dst->buckets[i] )
+            top = i;
+    }
+    dst->count = cur->count - last->count;
+    dst->sum = cur->sum - last->sum;
+
+    // the exact max is of cur only, the top bucket bounds the one of the diff
+    dst->max = 0;
+    if( top >= 0 )
+        dst->max = _hist_bucket_max( top ) < cur->max ? _hist_bucket_max( top ) : cur->max;
+}
+
+unsigned long hist_percentile( hist_t *hist, double pct )
+{
+    unsigned long rank = (unsigned long)(hist->count * pct / 100.0 + 0.5);
+    unsigned long count = 0;
+    int i;
+
+    if( hist->count == 0 )
+        return 0;
+    if( rank == 0 )
+        rank = 1;
+    for( i = 0; i < HIST_BUCKET_NUM; i++ ){
+        count += hist->buckets[i];
+        if( count >= rank )
+            break;
+    }
+    if( i == HIST_BUCKET_NUM )
+        return hist->max;
+
+    unsigned long value = _hist_bucket_max( i );
+    return value < hist->max ? value : hist->max;
+}
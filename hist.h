@@ -0,0 +1,31 @@
+#ifndef HIST_H_
+#define HIST_H_
+
+// log-linear latency histogram, in the way of HdrHistogram: every power of 2
+// is cut into 2^HIST_SUB_BITS linear buckets, so a percentile is within 1/32
+// of the value at any scale. one writer, read and merged by others without locks
+
+#define HIST_SUB_BITS 5
+#define HIST_MAX_BITS 36            // us, about 19 hours, longer ones go to the last bucket
+#define HIST_BUCKET_NUM ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct hist_s
+{
+    unsigned long count;
+    unsigned long sum;
+    unsigned long max;
+    unsigned long buckets[HIST_BUCKET_NUM];
+} hist_t;
+
+void hist_record( hist_t *hist, unsigned long value );
+
+// dst += src, src may be written meanwhile
+void hist_merge( hist_t *dst, hist_t *src );
+
+// dst = cur - last, of two copies of the same histogram. max is bounded by its bucket
+void hist_diff( hist_t *dst, hist_t *cur, hist_t *last );
+
+// the highest value of the bucket holding the pct-th percentile, 0 when empty
+unsigned long hist_percentile( hist_t *hist, double pct );
+
+#endif /*HIST_H_*/
@@ -0,0 +1,180 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "log.h"
+
+#define LOG_BATCH_SIZE 65536        // bytes per write()
+
+typedef struct log_entry_s log_entry_t;
+
+struct log_entry_s
+{
+    long ms;
+    log_site_t *site;
+    unsigned int suppressed;
+    char msg[LOG_MSG_SIZE];
+};
+
+// single producer (the worker) single consumer (the writer thread) ring,
+// head and tail never wrap, only the owner side stores its index
+static log_entry_t g_log_ring[LOG_RING_SIZE];
+static unsigned long g_log_head = 0;        // next to write out, writer thread
+static unsigned long g_log_tail = 0;        // next to fill, worker
+static unsigned long g_log_dropped = 0;     // ring full
+static int g_log_started = 0;
+
+int g_log_level = LOG_LEVEL;
+
+static const char *g_log_level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+static int _log_drain();
+
+static long _log_now_ms()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_REALTIME_COARSE, &ts );
+    return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void log_write( log_site_t *site, const char *fmt, ... )
+{
+    long ms = _log_now_ms();
+    long sec = ms / 1000;
+
+    if( site->sec != sec ){
+        site->sec = sec;
+        site->count = 0;
+    }
+    if( ++site->count > LOG_RATE_BURST ){
+        site->suppressed++;
+        return;
+    }
+
+    unsigned long tail = g_log_tail;
+    if( tail - __atomic_load_n( &g_log_head, __ATOMIC_ACQUIRE ) >= LOG_RING_SIZE ){
+        __atomic_add_fetch( &g_log_dropped, 1, __ATOMIC_RELAXED );
+        return;
+    }
+
+    log_entry_t *entry = &g_log_ring[tail & (LOG_RING_SIZE-1)];
+    entry->ms = ms;
+    entry->site = site;
+    entry->suppressed = site->suppressed;
+    site->suppressed = 0;
+
+    va_list args;
+    va_start( args, fmt );
+    vsnprintf( entry->msg, LOG_MSG_SIZE, fmt, args );
+    va_end( args );
+
+    __atomic_store_n( &g_log_tail, tail + 1, __ATOMIC_RELEASE );
+
+    // no writer thread (yet), write it out now
+    if( !g_log_started )
+        _log_drain();
+}
+
+static void _log_write_out( const char *buf, size_t len )
+{
+    while( len > 0 ){
+        ssize_t n = write( STDOUT_FILENO, buf, len );
+        if( n <= 0 )
+            return;
+        buf += n;
+        len -= n;
+    }
+}
+
+// format the pending entries with their prefix and write them out, in batches
+static int _log_drain()
+{
+    static char out[LOG_BATCH_SIZE];
+    static long prefix_sec = -1;
+    static char prefix[32];
+    size_t len = 0;
+    int num = 0;
+
+    unsigned long head = g_log_head;
+    unsigned long tail = __atomic_load_n( &g_log_tail, __ATOMIC_ACQUIRE );
+    unsigned long dropped = __atomic_exchange_n( &g_log_dropped, 0, __ATOMIC_RELAXED );
+
+    if( dropped > 0 )
+        len += snprintf( out, LOG_BATCH_SIZE, "WARN [log] ring full, %lu messages dropped\n", dropped );
+
+    for( ; head != tail; head++, num++ ){
+        log_entry_t *entry = &g_log_ring[head & (LOG_RING_SIZE-1)];
+        long sec = entry->ms / 1000;
+        if( sec != prefix_sec ){
+            time_t t = sec;
+            struct tm tm;
+            localtime_r( &t, &tm );
+            strftime( prefix, sizeof(prefix), "%Y-%m-%d %H:%M:%S", &tm );
+            prefix_sec = sec;
+        }
+
+        if( LOG_BATCH_SIZE - len < LOG_MSG_SIZE + 128 ){
+            _log_write_out( out, len );
+            len = 0;
+        }
+
+        len += snprintf( out + len, LOG_BATCH_SIZE - len, "%s.%03ld %s [%s:%d] %s", prefix, entry->ms % 1000,
+            g_log_level_names[entry->site->level], entry->site->file, entry->site->line, entry->msg );
+        if( entry->suppressed > 0 )
+            len += snprintf( out + len, LOG_BATCH_SIZE - len, " (%u suppressed)", entry->suppressed );
+        out[len++] = '\n';
+    }
+    __atomic_store_n( &g_log_head, head, __ATOMIC_RELEASE );
+
+    if( len > 0 )
+        _log_write_out( out, len );
+    return num;
+}
+
+static void *_log_writer( void *arg )
+{
+    while(1){
+        if( _log_drain() == 0 )
+            usleep( LOG_FLUSH_MS * 1000 );
+    }
+    return NULL;
+}
+
+void log_start()
+{
+    pthread_t tid;
+    g_log_started = 0;
+    if( pthread_create( &tid, NULL, _log_writer, NULL ) != 0 ){
+        fprintf(stderr, "start log writer failed, logs are written synchronously\n");
+        return;
+    }
+    pthread_detach( tid );
+    g_log_started = 1;
+}
+
+void log_flush()
+{
+    if( !g_log_started ){
+        _log_drain();
+        return;
+    }
+
+    while( __atomic_load_n( &g_log_head, __ATOMIC_ACQUIRE ) != g_log_tail )
+        usleep( 1000 );
+}
+
+int log_level_of_name( const char *name )
+{
+    int i;
+    for( i = LOG_LEVEL_DEBUG; i < LOG_LEVEL_NONE; i++ ){
+        if( strcasecmp( name, g_log_level_names[i] ) == 0 )
+            return i;
+    }
+    if( strcasecmp( name, "none" ) == 0 )
+        return LOG_LEVEL_NONE;
+    return -1;
+}
@@ -1,8 +1,84 @@
 #ifndef LOG_H_
 #define LOG_H_
 
-#define DEBUG_LINE() printf("[%s:%s] line=%d\r\n",__FILE__, __func__, __LINE__)
-#define DEBUG_ERR(fmt, args...) printf("\033[46;31m[%s:%d]\033[0m "#fmt" errno=%d, %m\r\n", __FILE__, __LINE__, ##args, errno, errno)
-#define DEBUG_INFO(fmt, args...) printf("\033[33m[%s:%d]\033[0m "#fmt"\r\n", __FILE__, __LINE__, ##args)
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_NONE 4
 
-#endif/*LOG_H_*/
\ No newline at end of file
+// messages below LOG_LEVEL are compiled out, set by: make LOG_LEVEL=0
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_RING_SIZE 4096          // pending messages per process, a power of 2
+#define LOG_MSG_SIZE 232            // longer messages are truncated
+#define LOG_RATE_BURST 20           // messages per callsite per second, the rest are counted only
+#define LOG_FLUSH_MS 10             // writer thread sleep when the ring is empty
+
+typedef struct log_site_s log_site_t;
+
+// one per callsite, only touched by the thread logging there
+struct log_site_s
+{
+    const char *file;
+    int line;
+    int level;
+    long sec;                   // rate limit window
+    unsigned int count;         // messages in the window
+    unsigned int suppressed;    // dropped by the rate limit, reported with the next message
+};
+
+extern int g_log_level;         // runtime level, >= LOG_LEVEL to take effect
+
+// the message is formatted into the ring, the prefix and write() are left to the writer thread
+void log_write( log_site_t *site, const char *fmt, ... ) __attribute__((format(printf, 2, 3)));
+
+// start the writer thread, again in a forked child
+void log_start();
+
+// wait until the ring is written out, before fork() and exit()
+void log_flush();
+
+int log_level_of_name( const char *name );
+
+#define LOG_AT(level, fmt, args...) do { \
+    if( (level) >= LOG_LEVEL && (level) >= g_log_level ){ \
+        static log_site_t _log_site = { __FILE__, __LINE__, (level), 0, 0, 0 }; \
+        log_write( &_log_site, fmt, ##args ); \
+    } \
+} while(0)
+
+#define LOG_NOTHING(fmt, args...) do { if (0) fprintf(stderr, fmt, ##args); } while (0)
+
+// compiled out: the arguments are type checked, but never evaluated
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(fmt, args...) LOG_AT(LOG_LEVEL_DEBUG, fmt, ##args)
+#else
+#define LOG_DEBUG(fmt, args...) LOG_NOTHING(fmt, ##args)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(fmt, args...) LOG_AT(LOG_LEVEL_INFO, fmt, ##args)
+#else
+#define LOG_INFO(fmt, args...) LOG_NOTHING(fmt, ##args)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(fmt, args...) LOG_AT(LOG_LEVEL_WARN, fmt, ##args)
+#else
+#define LOG_WARN(fmt, args...) LOG_NOTHING(fmt, ##args)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_ERROR
+#define LOG_ERROR(fmt, args...) LOG_AT(LOG_LEVEL_ERROR, fmt, ##args)
+#else
+#define LOG_ERROR(fmt, args...) LOG_NOTHING(fmt, ##args)
+#endif
+
+#define DEBUG_LINE() LOG_DEBUG("%s", __func__)
+#define DEBUG_ERR(fmt, args...) LOG_ERROR(fmt " errno=%d, %m", ##args, errno)
+#define DEBUG_INFO(fmt, args...) LOG_DEBUG(fmt, ##args)
+
+#endif/*LOG_H_*/
@@ -0,0 +1,80 @@
+#define _GNU_SOURCE
+#include "pipe.h"
+#include "log.h"
+
+static void _close_pipe( pipe_t *pipe )
+{
+    if( pipe->fds[0] > 0 )
+        close( pipe->fds[0] );
+    if( pipe->fds[1] > 0 )
+        close( pipe->fds[1] );
+    free( pipe );
+}
+
+void init_pipe_pool( worker_process_t *process )
+{
+    INIT_LIST_HEAD( &process->pipe_free_head );
+    process->pipe_free_num = 0;
+}
+
+// get an empty pipe from the free list, or create a new one
+pipe_t *alloc_pipe( worker_process_t *process )
+{
+    pipe_t *pipe = NULL;
+
+    if( !list_empty( &process->pipe_free_head ) ){
+        pipe = list_entry( process->pipe_free_head.next, pipe_t, list_node );
+        list_del( &pipe->list_node );
+        process->pipe_free_num--;
+        return pipe;
+    }
+
+    pipe = (pipe_t *)malloc( sizeof(pipe_t) );
+    if( pipe == NULL ){
+        LOG_ERROR("malloc pipe error");
+        return NULL;
+    }
+    memset( pipe, 0, sizeof(pipe_t) );
+
+    if( pipe2( pipe->fds, O_NONBLOCK|O_CLOEXEC ) < 0 ){
+        LOG_WARN("create pipe failed, %s", strerror(errno) );
+        free( pipe );
+        return NULL;
+    }
+
+    pipe->size = PIPE_BUF_SIZE;
+    if( process->config->pipe_size > 0 ){
+        int size = fcntl( pipe->fds[1], F_SETPIPE_SZ, process->config->pipe_size );
+        if( size < 0 )
+            LOG_WARN("set pipe size %d failed, %s", process->config->pipe_size, strerror(errno) );
+        else
+            pipe->size = size;
+    }
+
+    return pipe;
+}
+
+// a pipe still holding data can not be reused, close it
+void free_pipe( worker_process_t *process, pipe_t *pipe )
+{
+    if( pipe == NULL )
+        return;
+
+    if( pipe->data_length > 0 || process->pipe_free_num >= process->config->pipe_pool_size ){
+        _close_pipe( pipe );
+        return;
+    }
+
+    list_add( &pipe->list_node, &process->pipe_free_head );
+    process->pipe_free_num++;
+}
+
+void destroy_pipe_pool( worker_process_t *process )
+{
+    while( !list_empty( &process->pipe_free_head ) ){
+        pipe_t *pipe = list_entry( process->pipe_free_head.next, pipe_t, list_node );
+        list_del( &pipe->list_node );
+        _close_pipe( pipe );
+    }
+    process->pipe_free_num = 0;
+}
@@ -0,0 +1,14 @@
+#ifndef PIPE_H_
+#define PIPE_H_
+
+#include "server.h"
+
+void init_pipe_pool( worker_process_t *process );
+
+pipe_t *alloc_pipe( worker_process_t *process );
+
+void free_pipe( worker_process_t *process, pipe_t *pipe );
+
+void destroy_pipe_pool( worker_process_t *process );
+
+#endif /*PIPE_H_*/
@@ -0,0 +1,326 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "stats.h"
+
+// proxy_stat: live counters of a running proxy_server, summed over its workers.
+// reads the shared memory of the server, the workers never wait for it
+
+#define PCT_MAX 8
+
+static volatile int g_exiting = 0;
+static const char *g_hist_names[STATS_HIST_NUM] = { "connect", "first byte", "session" };
+static const char *g_cb_names[STATS_CB_NUM] = { "accept", "accept data", "connect", "relay", "other", "batch end" };
+static unsigned long g_ticks_per_ms = 1;
+static double g_pcts[PCT_MAX] = { 50, 90, 99, 99.9 };
+static int g_pct_num = 4;
+
+static void _signal_handler( int signo )
+{
+    g_exiting = 1;
+}
+
+static void _usage( const char *name )
+{
+    fprintf(stderr, "usage: %s [-i interval_ms] [-n count] [-w] [-l] [-q pct[,pct]...] [-e] [listen_port|stats_shm_name]\n"
+        "  -l: latency percentiles in us, of the connect, the first byte and the session\n"
+        "  -e: event loop, busy time, events per wakeup, share of busy time and avg ns by callback\n", name );
+}
+
+// one consistent enough copy of a counter set, each field read once
+static void _load_stats( worker_stats_t *dst, worker_stats_t *src )
+{
+    int i;
+    dst->pid = __atomic_load_n( &src->pid, __ATOMIC_RELAXED );
+    dst->session_num = __atomic_load_n( &src->session_num, __ATOMIC_RELAXED );
+    dst->accept_num = __atomic_load_n( &src->accept_num, __ATOMIC_RELAXED );
+    dst->up_byte_num = __atomic_load_n( &src->up_byte_num, __ATOMIC_RELAXED );
+    dst->down_byte_num = __atomic_load_n( &src->down_byte_num, __ATOMIC_RELAXED );
+    dst->connect_fail_num = __atomic_load_n( &src->connect_fail_num, __ATOMIC_RELAXED );
+    dst->recv_eagain_num = __atomic_load_n( &src->recv_eagain_num, __ATOMIC_RELAXED );
+    dst->send_eagain_num = __atomic_load_n( &src->send_eagain_num, __ATOMIC_RELAXED );
+    for( i = 0; i < STATS_CLOSE_BY_NUM; i++ )
+        dst->close_num[i] = __atomic_load_n( &src->close_num[i], __ATOMIC_RELAXED );
+    for( i = 0; i < STATS_HIST_NUM; i++ ){
+        memset( &dst->hists[i], 0, sizeof(hist_t) );
+        hist_merge( &dst->hists[i], &src->hists[i] );
+    }
+    dst->wait_ticks = __atomic_load_n( &src->wait_ticks, __ATOMIC_RELAXED );
+    dst->busy_ticks = __atomic_load_n( &src->busy_ticks, __ATOMIC_RELAXED );
+    for( i = 0; i < STATS_CB_NUM; i++ ){
+        dst->cb_num[i] = __atomic_load_n( &src->cb_num[i], __ATOMIC_RELAXED );
+        dst->cb_ticks[i] = __atomic_load_n( &src->cb_ticks[i], __ATOMIC_RELAXED );
+    }
+    memset( &dst->batch_hist, 0, sizeof(hist_t) );
+    hist_merge( &dst->batch_hist, &src->batch_hist );
+}
+
+static void _add_stats( worker_stats_t *sum, worker_stats_t *stats )
+{
+    int i;
+    sum->session_num += stats->session_num;
+    sum->accept_num += stats->accept_num;
+    sum->up_byte_num += stats->up_byte_num;
+    sum->down_byte_num += stats->down_byte_num;
+    sum->connect_fail_num += stats->connect_fail_num;
+    sum->recv_eagain_num += stats->recv_eagain_num;
+    sum->send_eagain_num += stats->send_eagain_num;
+    for( i = 0; i < STATS_CLOSE_BY_NUM; i++ )
+        sum->close_num[i] += stats->close_num[i];
+    for( i = 0; i < STATS_HIST_NUM; i++ )
+        hist_merge( &sum->hists[i], &stats->hists[i] );
+    sum->wait_ticks += stats->wait_ticks;
+    sum->busy_ticks += stats->busy_ticks;
+    for( i = 0; i < STATS_CB_NUM; i++ ){
+        sum->cb_num[i] += stats->cb_num[i];
+        sum->cb_ticks[i] += stats->cb_ticks[i];
+    }
+    hist_merge( &sum->batch_hist, &stats->batch_hist );
+}
+
+static void _print_loop_head( const char *name )
+{
+    int i;
+    printf("%-8s %6s %10s %8s %8s", name, "busy", "wakeups/s", "ev p50", "ev p99" );
+    for( i = 0; i < STATS_CB_NUM; i++ )
+        printf(" %18s", g_cb_names[i] );
+    printf("\n");
+}
+
+// the event loop since last over ms, since start when last is NULL
+static void _print_loop( const char *name, worker_stats_t *cur, worker_stats_t *last, long ms )
+{
+    static worker_stats_t zero;
+    static hist_t batch;
+    int i;
+
+    if( last == NULL )
+        last = &zero;
+    hist_diff( &batch, &cur->batch_hist, &last->batch_hist );
+    unsigned long busy = cur->busy_ticks - last->busy_ticks;
+    unsigned long wait = cur->wait_ticks - last->wait_ticks;
+
+    printf("%-8s %5lu%% %10.0f %8lu %8lu", name, busy * 100 / (busy + wait + 1),
+        ms > 0 ? batch.count * 1000.0 / ms : (double)batch.count,
+        hist_percentile( &batch, 50 ), hist_percentile( &batch, 99 ) );
+    for( i = 0; i < STATS_CB_NUM; i++ ){
+        unsigned long num = cur->cb_num[i] - last->cb_num[i];
+        unsigned long ticks = cur->cb_ticks[i] - last->cb_ticks[i];
+        char cell[32];
+        snprintf( cell, sizeof(cell), "%lu%% %luns", ticks * 100 / (busy + 1),
+            num ? ticks / num * 1000000 / g_ticks_per_ms : 0 );
+        printf(" %18s", cell );
+    }
+    printf("\n");
+}
+
+static void _print_latency_head( const char *name )
+{
+    int i;
+    printf("%-8s %-10s %10s %10s", name, "us", "count", "mean" );
+    for( i = 0; i < g_pct_num; i++ ){
+        char pct[16];
+        snprintf( pct, sizeof(pct), "p%g", g_pcts[i] );
+        printf(" %10s", pct );
+    }
+    printf(" %10s\n", "max" );
+}
+
+// percentiles of the sessions since last, all of them when last is NULL
+static void _print_latency( const char *name, worker_stats_t *cur, worker_stats_t *last )
+{
+    static hist_t hist;
+    int i, j;
+
+    for( i = 0; i < STATS_HIST_NUM; i++ ){
+        if( last )
+            hist_diff( &hist, &cur->hists[i], &last->hists[i] );
+        else
+            hist = cur->hists[i];
+
+        printf("%-8s %-10s %10lu %10lu", name, g_hist_names[i], hist.count, hist.count ? hist.sum / hist.count : 0 );
+        for( j = 0; j < g_pct_num; j++ )
+            printf(" %10lu", hist_percentile( &hist, g_pcts[j] ) );
+        printf(" %10lu\n", hist.max );
+    }
+}
+
+// "50,99,99.9"
+static int _parse_pcts( char *arg )
+{
+    char *token = strtok( arg, "," );
+    g_pct_num = 0;
+    while( token && g_pct_num < PCT_MAX ){
+        double pct = atof( token );
+        if( pct <= 0 || pct > 100 )
+            return -1;
+        g_pcts[g_pct_num++] = pct;
+        token = strtok( NULL, "," );
+    }
+    return g_pct_num > 0 ? 0 : -1;
+}
+
+// rates of cur since last over ms, totals when ms is 0
+static void _print_stats( const char *name, worker_stats_t *cur, worker_stats_t *last, long ms )
+{
+    static worker_stats_t zero;
+    double sec = ms > 0 ? ms / 1000.0 : 1;
+    if( ms == 0 )
+        last = &zero;
+
+    printf("%-8s %8ld %10.0f %10.2f %10.2f %8.0f %10.0f %10.0f %8.0f %8.0f %8.0f\n", name, cur->session_num,
+        (cur->accept_num - last->accept_num) / sec,
+        (cur->up_byte_num - last->up_byte_num) / sec / 1048576,
+        (cur->down_byte_num - last->down_byte_num) / sec / 1048576,
+        (cur->connect_fail_num - last->connect_fail_num) / sec,
+        (cur->recv_eagain_num - last->recv_eagain_num) / sec,
+        (cur->send_eagain_num - last->send_eagain_num) / sec,
+        (cur->close_num[CLOSE_BY_CLIENT] - last->close_num[CLOSE_BY_CLIENT]) / sec,
+        (cur->close_num[CLOSE_BY_SOCKD] - last->close_num[CLOSE_BY_SOCKD]) / sec,
+        (cur->close_num[CLOSE_BY_REMOTE] - last->close_num[CLOSE_BY_REMOTE]) / sec );
+}
+
+static long _now_ms()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+int main( int argc, char **argv )
+{
+    char name[STATS_NAME_LEN] = "/proxy_server.8080";
+    int interval_ms = 1000;
+    int count = -1;
+    int per_worker = 0;
+    int latency = 0;
+    int loop = 0;
+    int opt, i;
+
+    while( (opt = getopt(argc, argv, "i:n:wlq:eh")) != -1 ){
+        switch( opt ){
+            case 'i':
+                interval_ms = atoi(optarg);
+                break;
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 'w':
+                per_worker = 1;
+                break;
+            case 'l':
+                latency = 1;
+                break;
+            case 'e':
+                loop = 1;
+                break;
+            case 'q':
+                latency = 1;
+                if( _parse_pcts( optarg ) < 0 ){
+                    _usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            default:
+                _usage(argv[0]);
+                exit(-1);
+        }
+    }
+    if( optind < argc ){
+        if( strspn( argv[optind], "0123456789" ) == strlen( argv[optind] ) )
+            snprintf( name, STATS_NAME_LEN, "/proxy_server.%s", argv[optind] );
+        else
+            snprintf( name, STATS_NAME_LEN, "%s", argv[optind] );
+    }
+    if( interval_ms <= 0 ){
+        _usage(argv[0]);
+        exit(-1);
+    }
+
+    int fd = shm_open( name, O_RDONLY, 0 );
+    struct stat st;
+    if( fd < 0 || fstat( fd, &st ) < 0 || st.st_size < (off_t)sizeof(stats_shm_t) ){
+        fprintf(stderr, "open %s fail, %s\n", name, strerror(errno) );
+        exit(-1);
+    }
+    stats_shm_t *shm = (stats_shm_t *)mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( shm == MAP_FAILED ){
+        fprintf(stderr, "mmap %s fail, %s\n", name, strerror(errno) );
+        exit(-1);
+    }
+    if( __atomic_load_n( &shm->magic, __ATOMIC_ACQUIRE ) != STATS_MAGIC || shm->version != STATS_VERSION ||
+        st.st_size < (off_t)(sizeof(stats_shm_t) + shm->worker_num * sizeof(worker_stats_t)) ){
+        fprintf(stderr, "%s is not the stats of a proxy_server\n", name );
+        exit(-1);
+    }
+
+    int worker_num = shm->worker_num;
+    g_ticks_per_ms = shm->ticks_per_ms + 1;
+    worker_stats_t *cur = (worker_stats_t *)calloc( worker_num + 1, sizeof(worker_stats_t) );
+    worker_stats_t *last = (worker_stats_t *)calloc( worker_num + 1, sizeof(worker_stats_t) );
+    if( cur == NULL || last == NULL )
+        exit(-1);
+
+    signal(SIGINT, _signal_handler);
+    signal(SIGTERM, _signal_handler);
+
+    // the first line is the totals since start, then the rates per second,
+    // or the latencies of the sessions in the interval
+    long last_ms = 0;
+    int line = 0;
+    while( !g_exiting && count != 0 ){
+        long now_ms = _now_ms();
+        memset( &cur[worker_num], 0, sizeof(worker_stats_t) );
+        for( i = 0; i < worker_num; i++ ){
+            _load_stats( &cur[i], &shm->workers[i] );
+            _add_stats( &cur[worker_num], &cur[i] );
+        }
+
+        if( loop ){
+            _print_loop_head( line++ == 0 ? "total" : "interval" );
+            for( i = 0; per_worker && i < worker_num; i++ ){
+                char worker[16];
+                snprintf( worker, sizeof(worker), "w%d", i );
+                _print_loop( worker, &cur[i], last_ms ? &last[i] : NULL, last_ms ? now_ms - last_ms : 0 );
+            }
+            _print_loop( "all", &cur[worker_num], last_ms ? &last[worker_num] : NULL, last_ms ? now_ms - last_ms : 0 );
+        }
+        else if( latency ){
+            _print_latency_head( line++ == 0 ? "total" : "interval" );
+            for( i = 0; per_worker && i < worker_num; i++ ){
+                char worker[16];
+                snprintf( worker, sizeof(worker), "w%d", i );
+                _print_latency( worker, &cur[i], last_ms ? &last[i] : NULL );
+            }
+            _print_latency( "all", &cur[worker_num], last_ms ? &last[worker_num] : NULL );
+        }
+        else{
+            if( line++ % 20 == 0 )
+                printf("%-8s %8s %10s %10s %10s %8s %10s %10s %8s %8s %8s\n", line == 1 ? "total" : "/s",
+                    "active", "accepts", "up MB", "down MB", "conn err", "recv again", "send again",
+                    "close c", "close s", "close r" );
+            for( i = 0; per_worker && i < worker_num; i++ ){
+                char worker[16];
+                snprintf( worker, sizeof(worker), "w%d", i );
+                _print_stats( worker, &cur[i], &last[i], last_ms ? now_ms - last_ms : 0 );
+            }
+            _print_stats( "all", &cur[worker_num], &last[worker_num], last_ms ? now_ms - last_ms : 0 );
+        }
+        fflush( stdout );
+
+        worker_stats_t *tmp = last;
+        last = cur;
+        cur = tmp;
+        last_ms = now_ms;
+        if( count > 0 )
+            count--;
+        if( count != 0 )
+            usleep( interval_ms * 1000 );
+    }
+
+    munmap( shm, st.st_size );
+    free( cur );
+    free( last );
+    return 0;
+}
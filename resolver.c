@@ -0,0 +1,396 @@
+#define _GNU_SOURCE
+#include <strings.h>
+#include "resolver.h"
+#include "upstream.h"
+#include "balance.h"
+#include "log.h"
+#include "utils.h"
+
+#define DNS_HEADER_SIZE 12
+#define DNS_PACKET_SIZE 1232        // edns safe size, plain udp answers are 512 at most
+#define DNS_TYPE_A 1
+#define DNS_CLASS_IN 1
+#define DNS_MAX_BACKOFF 5           // retry delay doubled up to 1 << 5 times
+
+// a backend name, shared by the upstreams of the same name
+struct dns_entry_s
+{
+    const char *name;           // config->backends[].host
+    struct in_addr addrs[DNS_MAX_ADDRS];
+    int addr_num;               // 0: never resolved
+    long expire;                // ms, the addresses are kept after, until refreshed
+    unsigned short query_id;
+    unsigned int pending:1;     // query sent, not answered
+    long query_stamp;
+    int fail_num;               // failed queries in a row, backs off the retry
+    timer_node_t timer;         // refresh, or the query timeout
+};
+
+struct resolver_s
+{
+    connection_t con;           // udp socket connected to the nameserver, on epoll
+    dns_entry_t *entries;
+    int entry_num;
+    unsigned int rand_state;
+    unsigned long query_num;
+    unsigned long fail_num;
+};
+
+static unsigned int _rand( resolver_t *resolver )
+{
+    unsigned int x = resolver->rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    resolver->rand_state = x;
+    return x;
+}
+
+// "www.example.com" to 3www7example3com0, -1 when not a valid name
+static int _encode_name( const char *name, unsigned char *out, int size )
+{
+    int len = 0;
+    while( *name ){
+        const char *dot = strchr( name, '.' );
+        int label = dot ? dot - name : strlen( name );
+        if( label == 0 || label > 63 || len + label + 2 > size )
+            return -1;
+        out[len++] = label;
+        memcpy( out + len, name, label );
+        len += label;
+        name += label;
+        if( *name == '.' )
+            name++;
+    }
+    out[len++] = 0;
+    return len;
+}
+
+// skip a possibly compressed name, the offset after it, -1 when malformed
+static int _skip_name( const unsigned char *buf, int len, int off )
+{
+    while( off < len ){
+        unsigned char c = buf[off];
+        if( c == 0 )
+            return off + 1;
+        if( (c & 0xc0) == 0xc0 )
+            return off + 2 <= len ? off + 2 : -1;
+        off += c + 1;
+    }
+    return -1;
+}
+
+static unsigned short _get16( const unsigned char *p )
+{
+    return (p[0] << 8) | p[1];
+}
+
+static unsigned int _get32( const unsigned char *p )
+{
+    return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// the upstreams of the entry move to its first address
+static void _dns_apply( worker_process_t *process, dns_entry_t *entry )
+{
+    int i;
+    for( i = 0; i < process->upstream_num; i++ ){
+        upstream_t *upstream = &process->upstreams[i];
+        if( upstream->dns != entry )
+            continue;
+        if( upstream->resolved && upstream->addr.sin_addr.s_addr == entry->addrs[0].s_addr )
+            continue;
+
+        LOG_INFO("worker %d, backend %s:%d resolved to %s", process->worker_id, entry->name,
+            ntohs( upstream->addr.sin_port ), inet_ntoa( entry->addrs[0] ) );
+        // the pool is connected to the old address
+        drain_upstream_pool( process, upstream );
+        upstream->addr.sin_addr = entry->addrs[0];
+        // the logs and the hash ring keep the configured name
+        upstream->host.ipv4 = upstream->addr;
+        upstream->host.port = ntohs( upstream->addr.sin_port );
+        upstream->resolved = 1;
+        update_balancer( process, upstream );
+    }
+}
+
+static void _dns_query( worker_process_t *process, dns_entry_t *entry )
+{
+    resolver_t *resolver = process->resolver;
+    unsigned char buf[DNS_PACKET_SIZE];
+
+    memset( buf, 0, DNS_HEADER_SIZE );
+    entry->query_id = _rand( resolver );
+    buf[0] = entry->query_id >> 8;
+    buf[1] = entry->query_id;
+    buf[2] = 0x01;              // recursion desired
+    buf[5] = 1;                 // one question
+    int len = _encode_name( entry->name, buf + DNS_HEADER_SIZE, DNS_PACKET_SIZE - DNS_HEADER_SIZE - 4 );
+    len += DNS_HEADER_SIZE;
+    buf[len++] = 0;
+    buf[len++] = DNS_TYPE_A;
+    buf[len++] = 0;
+    buf[len++] = DNS_CLASS_IN;
+
+    entry->pending = 1;
+    entry->query_stamp = get_sys_ms();
+    resolver->query_num++;
+    if( send( resolver->con.fd, buf, len, 0 ) < 0 )
+        DEBUG_INFO("dns query %s send error, %s", entry->name, strerror(errno) );
+
+    // without epoll the timer reads the answer
+    long wait = process->epoll_fd > 0 ? DNS_TIMEOUT_MS : DNS_POLL_MS;
+    timer_add( &process->timer_wheel, &entry->timer, entry->query_stamp + wait );
+}
+
+// no answer, or no address in it: keep the stale addresses, and retry
+static void _dns_failed( worker_process_t *process, dns_entry_t *entry, const char *reason )
+{
+    int shift = entry->fail_num < DNS_MAX_BACKOFF ? entry->fail_num : DNS_MAX_BACKOFF;
+    long retry_ms = (long)DNS_RETRY_MS << shift;
+
+    process->resolver->fail_num++;
+    entry->fail_num++;
+    entry->pending = 0;
+    LOG_WARN("worker %d, resolve %s failed, %s, %d addresses kept, retry in %ld ms", process->worker_id,
+        entry->name, reason, entry->addr_num, retry_ms );
+    timer_add( &process->timer_wheel, &entry->timer, get_sys_ms() + retry_ms );
+}
+
+static void _dns_answer( worker_process_t *process, const unsigned char *buf, int len )
+{
+    resolver_t *resolver = process->resolver;
+    dns_entry_t *entry = NULL;
+    int i;
+
+    if( len < DNS_HEADER_SIZE || !(buf[2] & 0x80) || _get16( buf + 4 ) != 1 )
+        return;
+
+    unsigned short id = _get16( buf );
+    for( i = 0; i < resolver->entry_num; i++ ){
+        if( resolver->entries[i].pending && resolver->entries[i].query_id == id ){
+            entry = &resolver->entries[i];
+            break;
+        }
+    }
+    if( entry == NULL )
+        return;
+
+    // the question must be ours, not only the id
+    unsigned char qname[DNS_NAME_LEN + 2];
+    int qlen = _encode_name( entry->name, qname, sizeof(qname) );
+    int off = DNS_HEADER_SIZE;
+    if( off + qlen + 4 > len || strncasecmp( (const char *)buf + off, (const char *)qname, qlen ) != 0 )
+        return;
+    off += qlen + 4;
+
+    int rcode = buf[3] & 0x0f;
+    if( rcode != 0 ){
+        _dns_failed( process, entry, rcode == 3 ? "no such name" : "server failure" );
+        return;
+    }
+
+    struct in_addr addrs[DNS_MAX_ADDRS];
+    int addr_num = 0;
+    unsigned int ttl = DNS_MAX_TTL;
+    int answer_num = _get16( buf + 6 );
+    for( i = 0; i < answer_num; i++ ){
+        off = _skip_name( buf, len, off );
+        if( off < 0 || off + 10 > len )
+            break;
+        int type = _get16( buf + off );
+        int class = _get16( buf + off + 2 );
+        unsigned int rttl = _get32( buf + off + 4 );
+        int rdlen = _get16( buf + off + 8 );
+        off += 10;
+        if( off + rdlen > len )
+            break;
+        // the cname records of the chain are skipped, the addresses come after them
+        if( type == DNS_TYPE_A && class == DNS_CLASS_IN && rdlen == 4 && addr_num < DNS_MAX_ADDRS ){
+            memcpy( &addrs[addr_num++], buf + off, 4 );
+            if( rttl < ttl )
+                ttl = rttl;
+        }
+        off += rdlen;
+    }
+
+    if( addr_num == 0 ){
+        _dns_failed( process, entry, "no address" );
+        return;
+    }
+
+    if( ttl < DNS_MIN_TTL )
+        ttl = DNS_MIN_TTL;
+    memcpy( entry->addrs, addrs, addr_num * sizeof(struct in_addr) );
+    entry->addr_num = addr_num;
+    entry->pending = 0;
+    entry->fail_num = 0;
+    entry->expire = get_sys_ms() + ttl * 1000L;
+    DEBUG_INFO("resolved %s, %d addresses, ttl: %u s", entry->name, addr_num, ttl );
+
+    _dns_apply( process, entry );
+    timer_add( &process->timer_wheel, &entry->timer, entry->expire );
+}
+
+static void _resolver_recv( worker_process_t *process )
+{
+    unsigned char buf[DNS_PACKET_SIZE];
+    int len;
+
+    while( (len = recv( process->resolver->con.fd, buf, sizeof(buf), 0 )) > 0 )
+        _dns_answer( process, buf, len );
+}
+
+static void _resolver_read_cb( worker_process_t *process, int fd, int events, void *arg )
+{
+    _resolver_recv( process );
+}
+
+// refresh when expired, or the query is not answered in time
+static void _dns_timer_cb( timer_node_t *timer, void *arg )
+{
+    worker_process_t *process = (worker_process_t *)arg;
+    dns_entry_t *entry = list_entry( timer, dns_entry_t, timer );
+
+    if( !entry->pending ){
+        _dns_query( process, entry );
+        return;
+    }
+
+    if( process->epoll_fd <= 0 ){
+        _resolver_recv( process );
+        if( !entry->pending )
+            return;
+        if( get_sys_ms() - entry->query_stamp < DNS_TIMEOUT_MS ){
+            timer_add( &process->timer_wheel, &entry->timer, get_sys_ms() + DNS_POLL_MS );
+            return;
+        }
+    }
+
+    _dns_failed( process, entry, "timeout" );
+}
+
+int init_resolver( worker_process_t *process )
+{
+    config_t *config = process->config;
+    resolver_t *resolver;
+    int i, j;
+
+    for( i = 0; i < process->upstream_num; i++ ){
+        if( !process->upstreams[i].resolved )
+            break;
+    }
+    if( i == process->upstream_num )
+        return 0;
+
+    resolver = (resolver_t *)calloc( 1, sizeof(resolver_t) );
+    if( resolver == NULL )
+        return -1;
+    process->resolver = resolver;
+    resolver->rand_state = ((getpid() * 2654435761u) ^ get_sys_ms()) | 1;
+    resolver->entries = (dns_entry_t *)calloc( process->upstream_num, sizeof(dns_entry_t) );
+    if( resolver->entries == NULL )
+        return -1;
+
+    int fd = socket( AF_INET, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0 );
+    if( fd < 0 || connect( fd, (struct sockaddr *)&config->resolver_addr, sizeof(struct sockaddr_in) ) < 0 ){
+        LOG_ERROR("worker %d, resolver socket error, %s", process->worker_id, strerror(errno) );
+        if( fd >= 0 )
+            close( fd );
+        return -1;
+    }
+    resolver->con.fd = fd;
+    if( process->epoll_fd > 0 )
+        register_session_event( process->epoll_fd, &resolver->con, fd, EPOLLIN, _resolver_read_cb );
+
+    // one entry per distinct name
+    for( i = 0; i < process->upstream_num; i++ ){
+        upstream_t *upstream = &process->upstreams[i];
+        const char *name = config->backends[i].host;
+        unsigned char qname[DNS_NAME_LEN + 2];
+        if( upstream->resolved )
+            continue;
+        if( _encode_name( name, qname, sizeof(qname) ) < 0 ){
+            LOG_ERROR("invalid backend host: %s", name );
+            return -1;
+        }
+        for( j = 0; j < resolver->entry_num; j++ ){
+            if( strcasecmp( resolver->entries[j].name, name ) == 0 )
+                break;
+        }
+        if( j == resolver->entry_num ){
+            resolver->entries[j].name = name;
+            resolver->entries[j].timer.handler = _dns_timer_cb;
+            resolver->entry_num++;
+        }
+        upstream->dns = &resolver->entries[j];
+    }
+
+    for( i = 0; i < resolver->entry_num; i++ )
+        _dns_query( process, &resolver->entries[i] );
+
+    return 0;
+}
+
+void destroy_resolver( worker_process_t *process )
+{
+    resolver_t *resolver = process->resolver;
+    int i;
+    if( resolver == NULL )
+        return;
+
+    LOG_INFO("worker %d, resolver names: %d, queries: %lu, failed: %lu", process->worker_id,
+        resolver->entry_num, resolver->query_num, resolver->fail_num );
+
+    for( i = 0; i < resolver->entry_num; i++ )
+        timer_del( &process->timer_wheel, &resolver->entries[i].timer );
+    if( resolver->con.fd > 0 )
+        close( resolver->con.fd );
+    free( resolver->entries );
+    free( resolver );
+    process->resolver = NULL;
+}
+
+int resolver_addr( upstream_t *upstream, int index, struct sockaddr_in *addr )
+{
+    dns_entry_t *entry = upstream->dns;
+
+    if( entry == NULL || index >= entry->addr_num )
+        return -1;
+    *addr = upstream->addr;
+    addr->sin_addr = entry->addrs[index];
+    return 0;
+}
+
+int resolver_addr_of_conf( const char *host, struct sockaddr_in *addr )
+{
+    char ip[64] = "127.0.0.1";
+    int port = 53;
+
+    memset( addr, 0, sizeof(struct sockaddr_in) );
+    addr->sin_family = AF_INET;
+
+    if( host ){
+        if( sscanf( host, "%63[^:]:%d", ip, &port ) < 1 )
+            return -1;
+    }
+    else{
+        // the first ipv4 nameserver, the loopback one when none
+        char line[256], server[64];
+        FILE *fp = fopen( "/etc/resolv.conf", "r" );
+        while( fp && fgets( line, sizeof(line), fp ) ){
+            struct in_addr in;
+            if( sscanf( line, " nameserver %63s", server ) == 1 && inet_aton( server, &in ) ){
+                strcpy( ip, server );
+                break;
+            }
+        }
+        if( fp )
+            fclose( fp );
+    }
+
+    if( inet_aton( ip, &addr->sin_addr ) == 0 || port <= 0 || port > 65535 )
+        return -1;
+    addr->sin_port = htons( port );
+    return 0;
+}
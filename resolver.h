@@ -0,0 +1,18 @@
+#ifndef RESOLVER_H_
+#define RESOLVER_H_
+
+#include "server.h"
+
+// resolve the backends given by name with udp queries on the worker's loop,
+// and keep their addresses by the ttl of the answers, refreshed before used up
+int init_resolver( worker_process_t *process );
+
+void destroy_resolver( worker_process_t *process );
+
+// the index-th cached address of the upstream, -1 when it has no more
+int resolver_addr( upstream_t *upstream, int index, struct sockaddr_in *addr );
+
+// nameserver of -R, or the first one of /etc/resolv.conf
+int resolver_addr_of_conf( const char *host, struct sockaddr_in *addr );
+
+#endif /*RESOLVER_H_*/
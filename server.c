@@ -1,13 +1,30 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <sys/wait.h>
+#include <netinet/tcp.h>
 #include "server.h"
 #include "tcp.h"
 #include "log.h"
 #include "utils.h"
 #include "cb_method.h"
+#include "pipe.h"
+#include "uring.h"
+#include "upstream.h"
+#include "balance.h"
+#include "health.h"
+#include "circuit.h"
+#include "resolver.h"
+#include "sockopt.h"
+#include "udp.h"
+#include "stats.h"
 
 static int _register_listen_event(int epoll_fd, int fd, int events);
 static int _close_listen_socket( worker_process_t *process );
 static void _close_conenect(int epoll_fd, connection_t *con );
 
+static volatile sig_atomic_t g_master_exiting = 0;
+volatile sig_atomic_t g_worker_exiting = 0;
+
 static int _register_listen_event(int epoll_fd, int fd, int events)    
 {    
     struct epoll_event epv = {0, {0}};
@@ -32,7 +49,7 @@ static int _close_listen_socket( worker_process_t *process )
     struct epoll_event epv = {0, {0}};
 
     int op = EPOLL_CTL_DEL;
-    if( epoll_ctl( process->epoll_fd, op, process->listen_fd, &epv) < 0){
+    if( process->epoll_fd > 0 && epoll_ctl( process->epoll_fd, op, process->listen_fd, &epv) < 0){
         DEBUG_INFO("epoll del failed, fd:%d", process->listen_fd );
         return -1;
     }
@@ -48,6 +65,10 @@ static void _close_conenect(int epoll_fd, connection_t *con )
         return;
     
     con->closed = 1;
+    if( con->ready ){
+        list_del( &con->ready_node );
+        con->ready = 0;
+    }
 
     struct epoll_event epv = {0, {0}};
     epv.data.ptr = con;    
@@ -85,6 +106,7 @@ void register_session_event(int epoll_fd, connection_t *con, int fd, int events,
     
     con->fd = fd;    
     con->call_back = call_back;    
+    con->events = events;
 
     int op = EPOLL_CTL_ADD;
     if(epoll_ctl(epoll_fd, op, fd, &epv) < 0)    
@@ -101,24 +123,62 @@ void change_session_event(int epoll_fd, connection_t *con, int fd, int events,
     con->fd = fd;    
     con->call_back = call_back;    
 
+    // unchanged interest, the kernel has it already
+    if( con->events == events )
+        return;
+    con->events = events;
+
     int op = EPOLL_CTL_MOD;
     if(epoll_ctl(epoll_fd, op, fd, &epv) < 0)    
         DEBUG_INFO("epoll change failed, fd:%d, evnets:%d", fd, events);    
 } 
 
+// data only moves last_data_stamp, the timer catches up when it fires
+static long _session_deadline( config_t *config, session_t *session )
+{
+    long deadline;
+    if( session->stage == SERVER_DATA )
+        deadline = session->last_data_stamp + config->idle_timeout * 1000L;
+    else if( session->stage == SERVER_CONNECT_REMOTE )
+        deadline = session->connect_stamp + config->connect_timeout * 1000L;
+    else
+        deadline = session->accept_stamp + config->connect_timeout * 1000L;
+
+    if( config->max_lifetime > 0 && session->accept_stamp + config->max_lifetime * 1000L < deadline )
+        deadline = session->accept_stamp + config->max_lifetime * 1000L;
+    return deadline;
+}
+
+static void _session_timer_cb( timer_node_t *timer, void *arg )
+{
+    worker_process_t *process = (worker_process_t *)arg;
+    session_t *session = list_entry( timer, session_t, timer );
+
+    long deadline = _session_deadline( process->config, session );
+    if( deadline > get_sys_ms() ){
+        timer_add( &process->timer_wheel, &session->timer, deadline );
+        return;
+    }
+
+    DEBUG_INFO("session timeout, fd:%d, stage:%d, idle: %ld ms", session->client->fd, session->stage,
+        get_sys_ms() - (session->last_data_stamp ? session->last_data_stamp : session->accept_stamp) );
+    session->err = ETIMEDOUT;
+    process->backend->close( process, session );
+}
+
 session_t *create_session( worker_process_t *process, int fd)
 {
-    session_t *session = (session_t *)malloc(sizeof(session_t)+sizeof(connection_t));
+    session_t *session = (session_t *)slab_alloc( &process->session_pool );
     if( session == NULL ){
         DEBUG_INFO("malloc error,fd: %d", fd );
         return NULL;
     }
     memset( session, 0, sizeof(session_t) );
     
-    connection_t *con = (connection_t *)((void *)session+sizeof(session_t));
+    connection_t *con = (connection_t *)slab_alloc( &process->conn_pool );
     if( con == NULL ){
         DEBUG_INFO("malloc error,fd: %d", fd );
-        free(session );
+        slab_free( &process->session_pool, session );
         return NULL;
     }
 
@@ -127,6 +187,10 @@ session_t *create_session( worker_process_t *process, int fd)
     con->session = session;
     con->fd = fd;
 
+    session->accept_stamp = get_sys_ms();
+    session->timer.handler = _session_timer_cb;
+    timer_add( &process->timer_wheel, &session->timer, _session_deadline( process->config, session ) );
+
     return session;
 }
 
@@ -135,6 +199,11 @@ void close_session(worker_process_t *process, session_t *session)
     if( session->closed )
         return;
 
+    if( session->udp_remote ){
+        close_udp_flow( process, session );
+        return;
+    }
+
     session->closed = 1;
     session->closed_by = CLOSE_BY_SOCKD;
     
@@ -145,11 +214,14 @@ void close_session(worker_process_t *process, session_t *session)
         _close_conenect( process->epoll_fd, session->client );
     }
 
+    cancel_connect_attempts( process, session );
     if( session->remote )
     {
         if( session->remote->eof )
             session->closed_by = CLOSE_BY_REMOTE;
         _close_conenect( process->epoll_fd, session->remote );
+        if( session->remote->upstream )
+            release_upstream( process, session->remote->upstream );
     }
     if( session->remote ){
         DEBUG_INFO("%s:%d-%s:%d session closed, c-eof:%d, r-eof:%d", 
@@ -166,20 +238,88 @@ void close_session(worker_process_t *process, session_t *session)
     }
 
     process->session_num--;
+    STATS_ADD( process, session_num, -1 );
+    STATS_ADD( process, close_num[session->closed_by], 1 );
+    record_latency( process, STATS_HIST_SESSION, session->connect_us );
     list_del(&session->list_node);
+    timer_del( &process->timer_wheel, &session->timer );
     session->close_stamp = get_sys_ms();
 
-    if(session->remote){
-        free(session->remote);
-        session->remote = NULL;
+    if( session->client ){
+        clean_recv_buf( process, session->client );
+        process->byte_num += session->client->byte_num;
+        process->syscall_num += session->client->syscall_num;
+    }
+    if( session->remote ){
+        clean_recv_buf( process, session->remote );
+        process->byte_num += session->remote->byte_num;
+        process->syscall_num += session->remote->syscall_num;
+        DEBUG_INFO("up bytes: %lu, syscalls: %lu, down bytes: %lu, syscalls: %lu",
+            session->client->byte_num, session->client->syscall_num, 
+            session->remote->byte_num, session->remote->syscall_num );
     }
 
-    free(session);
-    session = NULL;
+    if( session->client && session->client->pipe ){
+        free_pipe( process, session->client->pipe );
+        session->client->pipe = NULL;
+    }
+    if( session->remote && session->remote->pipe ){
+        free_pipe( process, session->remote->pipe );
+        session->remote->pipe = NULL;
+    }
+
+    // later events of the same epoll batch may still point to the connections,
+    // so the memory is released by free_closed_sessions()
+    list_add_tail(&session->list_node, &process->session_close_head);
 
     return;
 }   
 
+// time to connect of the session, from its first attempt
+void count_connect( worker_process_t *process, session_t *session )
+{
+    record_latency( process, STATS_HIST_CONNECT, session->connect_us );
+    process->connect_num++;
+    if( session->attempt_total > 1 )
+        process->connect_retry_num++;
+}
+
+// pool sockets and lost connect attempts may have events left in this batch
+void free_connection_later( worker_process_t *process, connection_t *con )
+{
+    con->closed = 1;
+    list_add_tail( &con->pool_node, &process->conn_close_head );
+}
+
+void free_closed_sessions(worker_process_t *process)
+{
+    while( !list_empty( &process->conn_close_head ) ){
+        connection_t *con = list_entry( process->conn_close_head.next, connection_t, pool_node );
+        list_del( &con->pool_node );
+        slab_free( &process->conn_pool, con );
+    }
+
+    while( !list_empty( &process->session_close_head ) ){
+        session_t *session = list_entry( process->session_close_head.next, session_t, list_node );
+        list_del( &session->list_node );
+
+        if(session->remote){
+            slab_free( &process->conn_pool, session->remote );
+            session->remote = NULL;
+        }
+        if( session->udp_remote ){
+            slab_free( &process->conn_pool, session->udp_remote );
+            session->udp_remote = NULL;
+        }
+        if( session->client ){
+            slab_free( &process->conn_pool, session->client );
+            session->client = NULL;
+        }
+
+        slab_free( &process->session_pool, session );
+    }
+}
+
 int _init_listen_socket(  worker_process_t *process)    
 {    
     int tries =0;
@@ -188,16 +328,11 @@ int _init_listen_socket(  worker_process_t *process)
 
     listen_fd = socket(AF_INET, SOCK_STREAM, 0); 
     if( listen_fd == -1 ){
-        DEBUG_INFO("open socket fail, fd:%d", listen_fd );
+        LOG_ERROR("open socket fail, fd:%d", listen_fd );
         return -1;
     }
     
     process->listen_fd = listen_fd;
-    int ret = _register_listen_event( process->epoll_fd, listen_fd, EPOLLIN|EPOLLHUP|EPOLLERR );
-    if(ret < 0){
-         DEBUG_INFO("register epoll listen events fail, fd:%d", listen_fd );
-        return -1;
-    }
     
     for( tries=0; tries< 5; tries++ )
     {
@@ -207,21 +342,30 @@ int _init_listen_socket(  worker_process_t *process)
             int value = process->config->reuseaddr ==1?1:0;
             if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, (void *) &value, sizeof(int)) == -1)
             {
-                DEBUG_INFO("set SO_REUSEADDR fail, fd:%d", listen_fd );
+                LOG_WARN("set SO_REUSEADDR fail, fd:%d", listen_fd );
             }
         }
         
+        // every worker binds its own socket on the same port, the kernel spreads connections
+        if (process->config->listen_mode == LISTEN_MODE_REUSEPORT ) {
+            int value = 1;
+            if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, (void *) &value, sizeof(int)) == -1)
+            {
+                LOG_WARN("set SO_REUSEPORT fail, fd:%d", listen_fd );
+            }
+        }
+
         if (process->config->recv_buf_size ) {
             if (setsockopt(listen_fd, SOL_SOCKET, SO_RCVBUF, (void *) &process->config->recv_buf_size, sizeof(int)) == -1)
             {
-                DEBUG_INFO("set SO_RCVBUF fail, fd:%d", listen_fd );
+                LOG_WARN("set SO_RCVBUF fail, fd:%d", listen_fd );
             }
         }
 
         if (process->config->send_buf_size ) {
             if (setsockopt(listen_fd, SOL_SOCKET, SO_SNDBUF, (void *) &process->config->send_buf_size, sizeof(int)) == -1)
             {
-                DEBUG_INFO("set SO_SNDBUF fail, fd:%d", listen_fd );
+                LOG_WARN("set SO_SNDBUF fail, fd:%d", listen_fd );
             }
         }
 
@@ -233,8 +377,24 @@ int _init_listen_socket(  worker_process_t *process)
             }
         }
     
+        // data in the SYN of a client with our cookie is readable at accept
+        if (process->config->fastopen_qlen ) {
+            if (setsockopt(listen_fd, IPPROTO_TCP, TCP_FASTOPEN, (void *) &process->config->fastopen_qlen, sizeof(int)) == -1)
+            {
+                LOG_WARN("set TCP_FASTOPEN fail, fd:%d, %s", listen_fd, strerror(errno) );
+            }
+        }
+
+        // wake up accept with the first data, not the bare handshake
+        if (process->config->defer_accept ) {
+            if (setsockopt(listen_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, (void *) &process->config->defer_accept, sizeof(int)) == -1)
+            {
+                LOG_WARN("set TCP_DEFER_ACCEPT fail, fd:%d, %s", listen_fd, strerror(errno) );
+            }
+        }
+
         if( fcntl(listen_fd, F_SETFL, O_NONBLOCK) == -1 ){ // set non-blocking    
-            DEBUG_INFO("set O_NONBLOCK failed, fd=%d\n", listen_fd); 
+            LOG_ERROR("set O_NONBLOCK failed, fd=%d", listen_fd); 
             failed = 1;
             continue;
         }
@@ -250,7 +410,7 @@ int _init_listen_socket(  worker_process_t *process)
         if( bind(listen_fd, (  struct sockaddr*)&sin, sizeof(sin)) == -1 ){
             failed = 1;
             fprintf(stderr, "try to bind port:%d failed, %s\n", process->config->listen_port, strerror(errno) );
-            DEBUG_INFO("bind port:%d failed, fd=%d, %s", 
+            LOG_ERROR("bind port:%d failed, fd=%d, %s", 
                 process->config->listen_port, listen_fd, strerror(errno) ); 
             //close(listen_fd);
             continue;
@@ -258,7 +418,7 @@ int _init_listen_socket(  worker_process_t *process)
         
         if( listen(listen_fd, process->config->listen_backlog ) == -1){
             failed = 1;
-            DEBUG_INFO("listen failed, port:%d, backlog:%d, fd=%d\n", 
+            LOG_ERROR("listen failed, port:%d, backlog:%d, fd=%d", 
                 process->config->listen_port, process->config->listen_backlog, listen_fd); 
             continue;
         }
@@ -278,60 +438,93 @@ int _init_listen_socket(  worker_process_t *process)
     
 } 
 
+// STATS_CB_* of the callback
+static int _callback_type( void (*call_back)(worker_process_t *, int, int, void *) )
+{
+    if( call_back == tcp_data_transform_et_cb )
+        return STATS_CB_RELAY;
+    if( call_back == accpect_data_cb )
+        return STATS_CB_ACCEPT_DATA;
+    if( call_back == connect_remote_host_complete_cb )
+        return STATS_CB_CONNECT;
+    return STATS_CB_OTHER;
+}
+
+// returns the STATS_CB_* the time goes to
+static int _handle_epoll_event( worker_process_t *process, struct epoll_event *event )
+{
+    // pooled upstream connections have no session, their callback takes all events
+    connection_t *pooled = (connection_t*)event->data.ptr;
+    if( event->data.fd != process->listen_fd && pooled->session == NULL ){
+        if( !pooled->closed )
+            pooled->call_back( process, pooled->fd, event->events, pooled );
+        return STATS_CB_OTHER;
+    }
+
+    if( event->data.fd == process->listen_fd ){
+        if( event->events&(EPOLLIN|EPOLLOUT) )
+            accept_connect_cb( process, process->listen_fd, event->events );
+        if( event->events&(EPOLLERR|EPOLLHUP) )
+            DEBUG_INFO("epoll error events: %d, listen_fd: %d", event->events, event->data.fd );
+        return STATS_CB_ACCEPT;
+    }
+
+    connection_t *con = (connection_t*)event->data.ptr;
+    if( !con || con->closed )
+        return STATS_CB_OTHER;
+    int type = _callback_type( con->call_back );
+
+    if(event->events&(EPOLLIN|EPOLLOUT) )
+        con->call_back( process, con->fd, event->events, con );
+    if((event->events&(EPOLLERR|EPOLLHUP) ))
+    {
+        if( con->closed )
+            return type;
+        DEBUG_INFO("epoll error events: %d, fd:%d, sock:%s:%d", event->events, 
+            con->fd, con->peer_host.hostname, con->peer_host.port );
+        if( con->session )
+            close_session( process, con->session);
+    }
+    return type;
+}
+
 int wait_and_handle_epoll_events( worker_process_t *process, struct epoll_event *events, int timer )
 {
     // wait for events to happen 
+    unsigned long wait_start = stats_ticks();
     int fds = epoll_wait( process->epoll_fd, events, MAX_EVENTS, timer);      
+    unsigned long busy_start = stats_ticks();
+    STATS_ADD( process, wait_ticks, busy_start - wait_start );
     if(fds < 0){
         if( errno == EINTR ){
             DEBUG_INFO("epoll_wait interrupted, continue.");  
             return 0;
         }
-        DEBUG_INFO( "epoll_wait exit, %s", strerror(errno) );  
+        LOG_ERROR( "epoll_wait exit, %s", strerror(errno) );  
         return -1;  
     }
+    update_sys_ms();
+    hist_record( &process->stats->batch_hist, fds );
     
+    // each event is timed to the next, a few ns of tsc reads
+    unsigned long stamp = busy_start;
     int i = 0;
     for( i = 0; i < fds; i++){
-        if(events[i].events&(EPOLLIN|EPOLLOUT) )    
-        {    
-            if(events[i].events&EPOLLIN){
-            }
-
-            if( events[i].data.fd == process->listen_fd )
-            {
-                accept_connect_cb( process, process->listen_fd, events[i].events );
-            }
-            else
-            {
-                connection_t *con = (connection_t*)events[i].data.ptr; 
-                if( !con || con->closed )
-                    continue;
-                con->events = events[i].events;
-                con->call_back( process, con->fd, events[i].events, con );  
-            }   
-        }
-        if((events[i].events&(EPOLLERR|EPOLLHUP) ))     
-        {    
-            if( events[i].data.fd == process->listen_fd )
-            {
-                DEBUG_INFO("epoll error events: %d, listen_fd: %d", 
-                    events[i].events, events[i].data.fd );
-            }
-            else
-            {
-                connection_t *con = (connection_t*)events[i].data.ptr;  
-                if( !con || con->closed ){
-                    continue;
-                }
-                con->events = events[i].events;
-                DEBUG_INFO("epoll error events: %d, fd:%d, sock:%s:%d", con->events, 
-                    con->fd, con->peer_host.hostname, con->peer_host.port );
-                if( con->session )
-                    close_session( process, con->session);
-            }   
-        } 
+        int type = _handle_epoll_event( process, &events[i] );
+        unsigned long now = stats_ticks();
+        STATS_ADD( process, cb_num[type], 1 );
+        STATS_ADD( process, cb_ticks[type], now - stamp );
+        stamp = now;
     }
+
+    run_ready_connections( process );
+    timer_expire( &process->timer_wheel, get_sys_ms(), process );
+    free_closed_sessions( process );
+
+    unsigned long now = stats_ticks();
+    STATS_ADD( process, cb_num[STATS_CB_BATCH_END], 1 );
+    STATS_ADD( process, cb_ticks[STATS_CB_BATCH_END], now - stamp );
+    STATS_ADD( process, busy_ticks, now - busy_start );
     return 0;
 
 }
@@ -341,33 +534,415 @@ int init_local_server(worker_process_t *process, char* local_gost, int local_por
     config_t *config = process->config;
     strcpy(config->listen_host, local_gost);
     config->listen_port = local_port;
-    strcpy(config->target_host, proxy_host);
+    snprintf(config->target_host, DNS_NAME_LEN, "%s", proxy_host);
     config->target_port = proxy_port;
     config->listen_backlog = 2048;
     config->max_sessions = 4096;
-    config->recv_buf_size = 4096;
-    config->send_buf_size = 4096;
+    // 0: kernel default, the sockets of a session are tuned with its io buffers
+    config->recv_buf_size = 0;
+    config->send_buf_size = 0;
     config->reuseaddr = 1;
     config->keepalive = 1;
+    if( config->connect_timeout <= 0 )
+        config->connect_timeout = CONNECT_TIMEOUT;
+    if( config->connect_attempt_ms <= 0 )
+        config->connect_attempt_ms = CONNECT_ATTEMPT_MS;
+    if( config->connect_stagger_ms < 0 )
+        config->connect_stagger_ms = CONNECT_STAGGER_MS;
+    if( config->connect_retries < 0 )
+        config->connect_retries = CONNECT_RETRIES;
+    if( config->idle_timeout <= 0 )
+        config->idle_timeout = IDLE_TIMEOUT;
+    if( config->max_lifetime < 0 )
+        config->max_lifetime = MAX_LIFETIME;
+    // -t/-p is the only backend when none given by -B
+    if( config->backend_num == 0 ){
+        snprintf( config->backends[0].host, DNS_NAME_LEN, "%s", proxy_host );
+        config->backends[0].port = proxy_port;
+        config->backends[0].sock_profile = -1;
+        config->backend_num = 1;
+    }
+    int i;
+    for( i = 0; i < config->backend_num; i++ ){
+        if( config->backends[i].weight <= 0 )
+            config->backends[i].weight = 1;
+        if( config->backends[i].weight > MAX_BACKEND_WEIGHT )
+            config->backends[i].weight = MAX_BACKEND_WEIGHT;
+        if( config->backends[i].sock_profile < 0 )
+            config->backends[i].sock_profile = config->backend_sock_profile;
+    }
+    if( config->health_interval <= 0 )
+        config->health_interval = HEALTH_INTERVAL;
+    if( config->health_timeout <= 0 )
+        config->health_timeout = HEALTH_TIMEOUT;
+    if( config->health_timeout > config->health_interval )
+        config->health_timeout = config->health_interval;
+    if( config->health_rise <= 0 )
+        config->health_rise = HEALTH_RISE;
+    if( config->health_fall <= 0 )
+        config->health_fall = HEALTH_FALL;
+    if( config->circuit_failures <= 0 )
+        config->circuit_failures = CIRCUIT_FAILURES;
+    if( config->circuit_slow_ms < 0 )
+        config->circuit_slow_ms = CIRCUIT_SLOW_MS;
+    if( config->circuit_open_ms <= 0 )
+        config->circuit_open_ms = CIRCUIT_OPEN_MS;
+    if( config->circuit_trials <= 0 )
+        config->circuit_trials = CIRCUIT_TRIALS;
+    if( config->upstream_pool_max < config->upstream_pool_min )
+        config->upstream_pool_max = config->upstream_pool_min;
+    if( config->accept_budget <= 0 )
+        config->accept_budget = ACCEPT_BUDGET;
+    if( config->relay_budget == 0 )
+        config->relay_budget = RELAY_BUDGET;
+    if( config->udp_idle_timeout <= 0 )
+        config->udp_idle_timeout = UDP_IDLE_TIMEOUT;
+    if( config->udp_max_flows <= 0 )
+        config->udp_max_flows = UDP_MAX_FLOWS;
+    if( config->pipe_pool_size == 0 )
+        config->pipe_pool_size = PIPE_POOL_SIZE;
+    if( config->buf_pool_size == 0 )
+        config->buf_pool_size = BUF_POOL_SIZE;
+    if( config->min_buf_size == 0 )
+        config->min_buf_size = RECV_BUF_SIZE;
+    if( config->max_buf_size == 0 )
+        config->max_buf_size = MAX_RECV_BUF_SIZE;
+    // both power of 2, and at most BUF_CLASS_NUM sizes
+    while( config->min_buf_size & (config->min_buf_size-1) )
+        config->min_buf_size &= config->min_buf_size-1;
+    while( config->max_buf_size & (config->max_buf_size-1) )
+        config->max_buf_size &= config->max_buf_size-1;
+    if( config->max_buf_size < config->min_buf_size )
+        config->max_buf_size = config->min_buf_size;
+    if( config->max_buf_size > config->min_buf_size << (BUF_CLASS_NUM-1) )
+        config->max_buf_size = config->min_buf_size << (BUF_CLASS_NUM-1);
+    if( config->worker_num <= 0 )
+        config->worker_num = sysconf(_SC_NPROCESSORS_ONLN);
+    if( config->worker_num <= 0 )
+        config->worker_num = 1;
 
-    INIT_LIST_HEAD(&process->session_list_head);
+    // shared listen socket is created once, before the workers are forked
+    if( config->listen_mode == LISTEN_MODE_SHARED ){
+        int ret = _init_listen_socket(process);
+        if(ret < 0){
+            LOG_ERROR("_init_listen_socket faild");
+            return -1;
+        }
+        LOG_INFO("shared listen fd: %d", process->listen_fd);
+    }
+
+    return 0;
+}
+
+static int _epoll_backend_init(worker_process_t *process)
+{
+    config_t *config = process->config;
 
     process->epoll_fd = epoll_create(MAX_EVENTS);    
     if(process->epoll_fd <= 0) {
-        DEBUG_INFO("create epoll failed:%d, %s", errno, strerror(errno) );  
+        LOG_ERROR("create epoll failed:%d, %s", errno, strerror(errno) );  
         return -1;
     }
 
-    int ret = _init_listen_socket(process);
+    // wake up only one of the workers waiting on the shared socket
+    int events = EPOLLIN|EPOLLHUP|EPOLLERR;
+    if( config->listen_mode == LISTEN_MODE_SHARED && config->worker_num > 1 )
+        events |= EPOLLEXCLUSIVE;
+
+    int ret = _register_listen_event( process->epoll_fd, process->listen_fd, events );
     if(ret < 0){
-        DEBUG_INFO("_init_listen_socket faild");
+        LOG_ERROR("register epoll listen events fail, fd:%d", process->listen_fd );
         return -1;
     }
-    DEBUG_INFO("listen fd: %d", process->listen_fd);
 
     return 0;
 }
 
+static int _epoll_backend_run(worker_process_t *process)
+{
+    struct epoll_event *events = (struct epoll_event *)calloc( MAX_EVENTS, sizeof(struct epoll_event) ); 
+    if( events == NULL )
+        return -1;
+
+    // wake up for the next timer, or at least every second
+    while( !g_worker_exiting ){
+        // connections out of budget go on without waiting
+        int timeout = list_empty( &process->ready_head ) ? timer_next_timeout( &process->timer_wheel, get_sys_ms(), 1000 ) : 0;
+        if( wait_and_handle_epoll_events( process, events, timeout )< 0 )
+            break;
+    }
+
+    free( events );
+    return 0;
+}
+
+static void _epoll_backend_done(worker_process_t *process)
+{
+}
+
+event_backend_t epoll_backend = {
+    "epoll",
+    _epoll_backend_init,
+    _epoll_backend_run,
+    _epoll_backend_done,
+    close_session
+};
+
+// per worker: listen socket (reuseport mode), pools and event backend
+int init_worker_process(worker_process_t *process)
+{
+    config_t *config = process->config;
+
+    attach_worker_stats( process );
+    INIT_LIST_HEAD(&process->session_list_head);
+    INIT_LIST_HEAD(&process->session_close_head);
+    INIT_LIST_HEAD(&process->conn_close_head);
+    INIT_LIST_HEAD(&process->ready_head);
+    init_pipe_pool(process);
+    update_sys_ms();
+    timer_wheel_init( &process->timer_wheel, get_sys_ms() );
+
+    // sessions and connections never touch malloc until max_sessions is exceeded
+    if( slab_init( &process->session_pool, sizeof(session_t), config->max_sessions ) < 0 ||
+        slab_init( &process->conn_pool, sizeof(connection_t), config->max_sessions*2 ) < 0 ){
+        LOG_ERROR("init session pool failed, max_sessions: %d", config->max_sessions );
+        return -1;
+    }
+
+    // io buffers are leased only while holding data, idle ones beyond the pool are freed.
+    // only the min size is preallocated, the bigger ones are cached in fewer numbers
+    int i;
+    for( i = 0; i < BUF_CLASS_NUM; i++ ){
+        if( slab_init( &process->buf_pools[i], config->min_buf_size << i, 
+                i == 0 ? config->buf_pool_size : 0 ) < 0 ){
+            LOG_ERROR("init buffer pool failed, size: %d", config->buf_pool_size );
+            return -1;
+        }
+        process->buf_pools[i].max_free = (config->buf_pool_size >> i) + 1;
+    }
+
+    if( config->listen_mode == LISTEN_MODE_REUSEPORT ){
+        int ret = _init_listen_socket(process);
+        if(ret < 0){
+            LOG_ERROR("_init_listen_socket faild");
+            return -1;
+        }
+    }
+
+    // io_uring needs a recent kernel, epoll is always there
+    process->backend = &epoll_backend;
+    if( config->event_backend == EVENT_BACKEND_URING ){
+        if( uring_backend.init( process ) == 0 )
+            process->backend = &uring_backend;
+        else
+            LOG_WARN("worker %d, io_uring not available, fall back to epoll", process->worker_id );
+    }
+    if( process->backend == &epoll_backend && epoll_backend.init( process ) < 0 )
+        return -1;
+
+    if( init_upstreams( process ) < 0 || init_balancer( process ) < 0 || init_resolver( process ) < 0 )
+        return -1;
+    init_health_check( process );
+    init_circuit_breaker( process );
+    if( init_udp_relay( process ) < 0 )
+        return -1;
+
+    LOG_INFO("worker %d, pid: %d, listen fd: %d, backend: %s, client sockets: %s", process->worker_id, getpid(), 
+        process->listen_fd, process->backend->name, sock_profile_name( config->client_sock_profile ) );
+
+    return 0;
+}
+
+int run_worker_process(worker_process_t *process)
+{
+    int i;
+    process->backend->run( process );
+    destroy_udp_relay( process );
+    destroy_circuit_breaker( process );
+    destroy_health_check( process );
+    destroy_resolver( process );
+    destroy_balancer( process );
+    destroy_upstreams( process );
+    free_closed_sessions( process );
+    process->backend->done( process );
+    destroy_pipe_pool(process);
+
+    LOG_INFO("worker %d, connect attempts: %lu, failed: %lu, timed out: %lu, sessions connected: %lu, by retry: %lu",
+        process->worker_id, process->connect_attempt_num, process->connect_fail_num, process->connect_timeout_num,
+        process->connect_num, process->connect_retry_num );
+
+    // of the slot, a restarted worker includes the ones before it
+    static const char *hist_names[STATS_HIST_NUM] = { "connect", "first byte", "session" };
+    for( i = 0; i < STATS_HIST_NUM; i++ ){
+        hist_t *hist = &process->stats->hists[i];
+        LOG_INFO("worker %d, %s us, count: %lu, p50: %lu, p99: %lu, p99.9: %lu, max: %lu", process->worker_id,
+            hist_names[i], hist->count, hist_percentile( hist, 50 ), hist_percentile( hist, 99 ),
+            hist_percentile( hist, 99.9 ), hist->max );
+    }
+
+    worker_stats_t *stats = process->stats;
+    unsigned long ticks_per_ms = process->stats_shm->ticks_per_ms + 1;
+    LOG_INFO("worker %d, event loop busy: %lu%%, wakeups: %lu, events per wakeup p50: %lu, p99: %lu, max: %lu",
+        process->worker_id, stats->busy_ticks * 100 / (stats->busy_ticks + stats->wait_ticks + 1),
+        stats->batch_hist.count, hist_percentile( &stats->batch_hist, 50 ), hist_percentile( &stats->batch_hist, 99 ),
+        stats->batch_hist.max );
+    static const char *cb_names[STATS_CB_NUM] = { "accept", "accept data", "connect", "relay", "other", "batch end" };
+    for( i = 0; i < STATS_CB_NUM; i++ ){
+        if( stats->cb_num[i] == 0 )
+            continue;
+        LOG_INFO("worker %d, %s calls: %lu, avg: %lu ns, busy: %lu%%", process->worker_id, cb_names[i],
+            stats->cb_num[i], stats->cb_ticks[i] / stats->cb_num[i] * 1000000 / ticks_per_ms,
+            stats->cb_ticks[i] * 100 / (stats->busy_ticks + 1) );
+    }
+
+    if( process->config->fastopen_connect )
+        LOG_INFO("worker %d, fast open attempts with data: %lu, bytes in SYN: %lu",
+            process->worker_id, process->fastopen_num, process->fastopen_byte_num );
+
+    LOG_INFO("worker %d, session pool hit: %lu, miss: %lu, connection pool hit: %lu, miss: %lu",
+        process->worker_id, process->session_pool.hit, process->session_pool.miss,
+        process->conn_pool.hit, process->conn_pool.miss );
+    LOG_INFO("worker %d, relayed bytes: %lu, syscalls: %lu, syscalls per MB: %lu, out of budget: %lu",
+        process->worker_id, process->byte_num, process->syscall_num, 
+        process->byte_num ? process->syscall_num * 1048576 / process->byte_num : 0, process->relay_defer_num );
+    slab_destroy(&process->session_pool);
+    slab_destroy(&process->conn_pool);
+    for( i = 0; i < BUF_CLASS_NUM; i++ ){
+        LOG_INFO("worker %d, buffer pool %d hit: %lu, miss: %lu", process->worker_id,
+            process->config->min_buf_size << i, process->buf_pools[i].hit, process->buf_pools[i].miss );
+        slab_destroy(&process->buf_pools[i]);
+    }
+
+    int ret = _close_listen_socket(process);
+    if(ret < 0){
+        LOG_ERROR("_close_listen_socket faild");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void _bind_worker_cpu( int worker_id )
+{
+    int cpu_num = sysconf(_SC_NPROCESSORS_ONLN);
+    if( cpu_num <= 0 )
+        return;
+
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(worker_id % cpu_num, &mask);
+    if( sched_setaffinity(0, sizeof(mask), &mask) < 0 )
+        LOG_WARN("bind worker %d to cpu failed, %s", worker_id, strerror(errno) );
+}
+
+static void _worker_signal_handler( int signo )
+{
+    g_worker_exiting = 1;
+}
+
+// stop the event loop at the next wakeup, and log the stats of the worker.
+// no SA_RESTART, a waiting loop wakes up at once
+static void _catch_worker_signals()
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = _worker_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+static pid_t _spawn_worker_process( worker_process_t *master, int worker_id )
+{
+    log_flush();
+    pid_t pid = fork();
+    if( pid < 0 ){
+        LOG_ERROR("fork worker %d failed, %s", worker_id, strerror(errno) );
+        return -1;
+    }
+    if( pid > 0 )
+        return pid;
+
+    // child: own copy of master's process, config and shared listen fd
+    _catch_worker_signals();
+    log_start();
+    master->worker_id = worker_id;
+    _bind_worker_cpu( worker_id );
+
+    if( init_worker_process( master ) < 0 ){
+        LOG_ERROR("init_worker_process %d faild", worker_id);
+        exit(-2);
+    }
+    exit( run_worker_process( master ) < 0 ? -2 : 0 );
+}
+
+static void _master_signal_handler( int signo )
+{
+    g_master_exiting = 1;
+}
+
+// fork config->worker_num workers and restart the ones crashed
+static int _run_master_process( worker_process_t *master )
+{
+    int worker_num = master->config->worker_num;
+    int i;
+    pid_t *pids = (pid_t *)calloc( worker_num, sizeof(pid_t) );
+    if( pids == NULL )
+        return -1;
+
+    // no SA_RESTART, waitpid() must return on signal
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = _master_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    for( i = 0; i < worker_num; i++ )
+        pids[i] = _spawn_worker_process( master, i );
+
+    while( !g_master_exiting ){
+        int status;
+        pid_t pid = waitpid( -1, &status, 0 );
+        if( pid < 0 ){
+            if( errno == EINTR )
+                continue;
+            break;
+        }
+
+        for( i = 0; i < worker_num; i++ ){
+            if( pids[i] != pid )
+                continue;
+            LOG_INFO("worker %d exit, pid: %d, status: %d", i, pid, status );
+            pids[i] = 0;
+            if( WIFSIGNALED(status) && !g_master_exiting )
+                pids[i] = _spawn_worker_process( master, i );
+        }
+    }
+
+    for( i = 0; i < worker_num; i++ ){
+        if( pids[i] > 0 )
+            kill( pids[i], SIGTERM );
+    }
+    while( waitpid( -1, NULL, 0 ) > 0 )
+        ;
+
+    free( pids );
+    return 0;
+}
+
+static void _usage( const char *name )
+{
+    fprintf(stderr, "usage: %s [-l listen_port] [-t target_host] [-p target_port] [-m copy|splice] [-P pipe_size]"
+        " [-w worker_num] [-L reuseport|shared] [-b min_buf_size:max_buf_size] [-K] [-A accept_budget] [-r relay_budget]"
+        " [-E epoll|uring] [-T idle_timeout:connect_timeout:max_lifetime] [-c attempt_ms:stagger_ms:retries] [-v debug|info|warn|error|none]"
+        " [-U pool_min:pool_max] [-B host:port[:weight[:profile]]]... [-S rr|wrr|lc|p2c|hash]"
+        " [-H off|interval_ms:timeout_ms:rise:fall] [-C off|failures:slow_ms:open_ms:trials]"
+        " [-R nameserver[:port]] [-F fastopen_qlen[:connect]] [-D defer_accept_s]"
+        " [-O default|latency|bulk[:backend_profile]] [-u udp_port[:idle_timeout:max_flows[:plain|mmsg|gso]]]"
+        " [-M stats_shm_name]\n", name );
+}
+
 int main(int argc, char **argv)
 {
     worker_process_t *process = (worker_process_t *)malloc(sizeof(worker_process_t));
@@ -376,28 +951,244 @@ int main(int argc, char **argv)
     config_t* config = (config_t*)malloc(sizeof(config_t));
     memset(config, 0, sizeof(config_t));
     process->config = config;
+    config->worker_num = 1;
+    config->sock_buf_tune = 1;
+    config->health_check = 1;
+    config->circuit_breaker = 1;
+    config->circuit_slow_ms = -1;
+    config->connect_stagger_ms = -1;
+    config->connect_retries = -1;
+    config->udp_mode = UDP_MODE_GSO;
 
-    int ret = init_local_server(process, "127.0.0.1", 8080, "42.123.76.71", 8080);
-    if(ret < 0){
-        DEBUG_INFO("init_local_server faild");
-        exit(-2);
+    char *target_host = "42.123.76.71";
+    char *resolver = NULL;
+    int target_port = 8080;
+    int listen_port = 8080;
+    int opt;
+    while( (opt = getopt(argc, argv, "l:t:p:m:P:w:L:b:KA:r:E:T:c:v:U:B:S:H:C:R:F:D:O:u:M:h")) != -1 ){
+        switch( opt ){
+            case 'l':
+                listen_port = atoi(optarg);
+                break;
+            case 't':
+                target_host = optarg;
+                break;
+            case 'p':
+                target_port = atoi(optarg);
+                break;
+            case 'm':
+                if( strcmp(optarg, "splice") == 0 )
+                    config->relay_mode = RELAY_MODE_SPLICE;
+                else if( strcmp(optarg, "copy") == 0 )
+                    config->relay_mode = RELAY_MODE_COPY;
+                else{
+                    _usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'P':
+                config->pipe_size = atoi(optarg);
+                break;
+            case 'w':
+                config->worker_num = atoi(optarg);  // 0: one worker per cpu
+                break;
+            case 'L':
+                if( strcmp(optarg, "reuseport") == 0 )
+                    config->listen_mode = LISTEN_MODE_REUSEPORT;
+                else if( strcmp(optarg, "shared") == 0 )
+                    config->listen_mode = LISTEN_MODE_SHARED;
+                else{
+                    _usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'b':
+                // the largest class, min_buf_size << (BUF_CLASS_NUM-1), fits an int
+                if( sscanf(optarg, "%d:%d", &config->min_buf_size, &config->max_buf_size) != 2 ||
+                    config->min_buf_size <= 0 || config->max_buf_size <= 0 ||
+                    config->min_buf_size > INT_MAX >> (BUF_CLASS_NUM-1) ){
+                    _usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'A':
+                config->accept_budget = atoi(optarg);
+                break;
+            case 'r':
+                config->relay_budget = atoi(optarg);  // -1: relay until EAGAIN
+                break;
+            case 'K':
+                config->sock_buf_tune = 0;  // leave kernel socket buffers alone
+                break;
+            case 'v':
+                // levels compiled out by LOG_LEVEL stay off
+                g_log_level = log_level_of_name(optarg);
+                if( g_log_level < 0 ){
+                    _usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'B': {
+                // repeated for every backend, weight defaults to 1, profile to the one of -O
+                backend_conf_t *backend = &config->backends[config->backend_num];
+                char profile[16] = "";
+                if( config->backend_num >= MAX_BACKENDS ||
+                    sscanf(optarg, "%255[^:]:%d:%d:%15s", backend->host, &backend->port, &backend->weight, profile) < 2 ){
+                    _usage(argv[0]);
+                    exit(-1);
+                }
+                backend->sock_profile = -1;
+                if( profile[0] && (backend->sock_profile = sock_profile_of_name(profile)) < 0 ){
+                    _usage(argv[0]);
+                    exit(-1);
+                }
+                config->backend_num++;
+                break;
+            }
+            case 'H':
+                if( strcmp(optarg, "off") == 0 )
+                    config->health_check = 0;
+                else if( sscanf(optarg, "%d:%d:%d:%d", &config->health_interval, &config->health_timeout,
+                        &config->health_rise, &config->health_fall) < 1 ){
+                    _usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'C':
+                // slow_ms 0: only failed connects count
+                if( strcmp(optarg, "off") == 0 )
+                    config->circuit_breaker = 0;
+                else if( sscanf(optarg, "%d:%d:%d:%d", &config->circuit_failures, &config->circuit_slow_ms,
+                        &config->circuit_open_ms, &config->circuit_trials) < 1 ){
+                    _usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'F':
+                // connect 0: the listen socket only, else the remote is opened by fast open too.
+                // the first bytes may come twice to the remote, they must be idempotent
+                config->fastopen_connect = 1;
+                if( sscanf(optarg, "%d:%u", &config->fastopen_qlen, &config->fastopen_connect) < 1 ||
+                        config->fastopen_qlen < 0 ){
+                    _usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'O': {
+                // accepted sockets, and the backends without a profile of their own
+                char client[16] = "", backend[16] = "";
+                if( sscanf(optarg, "%15[^:]:%15s", client, backend) < 1 ||
+                    (config->client_sock_profile = sock_profile_of_name(client)) < 0 ||
+                    (config->backend_sock_profile = sock_profile_of_name(backend[0] ? backend : client)) < 0 ){
+                    _usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'u': {
+                // udp relay to the same backends, idle timeout in s, flows per worker, io mode
+                char mode[8] = "";
+                if( sscanf(optarg, "%d:%d:%d:%7s", &config->udp_listen_port, &config->udp_idle_timeout,
+                        &config->udp_max_flows, mode) < 1 ||
+                    (mode[0] && (config->udp_mode = udp_mode_of_name(mode)) < 0) ){
+                    _usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'D':
+                config->defer_accept = atoi(optarg);
+                break;
+            case 'M':
+                // read by proxy_stat, default /proxy_server.<listen_port>
+                snprintf( config->stats_name, STATS_NAME_LEN, "%s", optarg );
+                break;
+            case 'R':
+                // nameserver of the backends given by name
+                resolver = optarg;
+                break;
+            case 'S':
+                config->balance_policy = balance_policy_of_name(optarg);
+                if( config->balance_policy < 0 ){
+                    _usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'U':
+                // pre-connected upstream sockets per worker, 0:0 disables the pool
+                if( sscanf(optarg, "%d:%d", &config->upstream_pool_min, &config->upstream_pool_max) < 1 ){
+                    _usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'c':
+                // per attempt deadline, parallel attempt delay (0: sequential), attempts after the first
+                if( sscanf(optarg, "%d:%d:%d", &config->connect_attempt_ms, &config->connect_stagger_ms,
+                        &config->connect_retries) < 1 ){
+                    _usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'T':
+                // seconds, max_lifetime 0: unlimited
+                if( sscanf(optarg, "%d:%d:%d", &config->idle_timeout, &config->connect_timeout, 
+                        &config->max_lifetime) < 1 ){
+                    _usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'E':
+                if( strcmp(optarg, "uring") == 0 )
+                    config->event_backend = EVENT_BACKEND_URING;
+                else if( strcmp(optarg, "epoll") == 0 )
+                    config->event_backend = EVENT_BACKEND_EPOLL;
+                else{
+                    _usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            default:
+                _usage(argv[0]);
+                exit(-1);
+        }
     }
 
-    struct epoll_event *events = (struct epoll_event *)calloc( MAX_EVENTS, sizeof(struct epoll_event) ); 
-    if( events == NULL )
-        return ;
-
-    while(1){
-        if( wait_and_handle_epoll_events( process, events, 1000 )< 0 )
-            break;
-        update_sys_ms();
+    if( resolver_addr_of_conf( resolver, &config->resolver_addr ) < 0 ){
+        _usage(argv[0]);
+        exit(-1);
     }
 
-    ret = _close_listen_socket(process);
+    // splice() can not take MSG_NOSIGNAL, a closed peer is reported by EPIPE
+    signal(SIGPIPE, SIG_IGN);
+
+    log_start();
+    atexit(log_flush);
+
+    int ret = init_local_server(process, "127.0.0.1", listen_port, target_host, target_port);
     if(ret < 0){
-        DEBUG_INFO("_close_listen_socket faild");
+        LOG_ERROR("init_local_server faild");
+        exit(-2);
+    }
+    if( init_stats(process) < 0 ){
+        LOG_ERROR("init_stats faild");
         exit(-2);
     }
 
-    DEBUG_INFO("server close");
-}
\ No newline at end of file
+    if( config->worker_num == 1 ){
+        _catch_worker_signals();
+        ret = init_worker_process(process);
+        if(ret < 0){
+            LOG_ERROR("init_worker_process faild");
+            exit(-2);
+        }
+        ret = run_worker_process(process);
+    }
+    else
+        ret = _run_master_process(process);
+
+    destroy_stats(process);
+    if(ret < 0)
+        exit(-2);
+
+    LOG_INFO("server close");
+}
@@ -7,6 +7,7 @@
 #include <sys/ioctl.h>
 #include <sys/timeb.h>
 #include <sys/msg.h>
+#include <sys/uio.h>
 #include <netinet/in.h>    
 #include <arpa/inet.h>
 #include <net/if.h>
@@ -18,15 +19,26 @@
 #include <stdlib.h>  
 #include <netdb.h>  
 #include <string.h> 
+#include <limits.h>
 #include <signal.h>
 #include <setjmp.h>
 
 #include "rbtree.h"
 #include "list.h"
+#include "slab.h"
+#include "timer.h"
 
 #define HOST_NAME_LEN 32
-#define RECV_BUF_SIZE 4096
+#define DNS_NAME_LEN 256            // backend host, an address or a name to resolve
+#define RECV_BUF_SIZE 4096          // default min io buffer size, must be a power of 2
+#define MAX_RECV_BUF_SIZE 262144    // default max io buffer size
+#define BUF_CLASS_NUM 8             // io buffer sizes: min_buf_size << [0, BUF_CLASS_NUM)
+#define BUF_GROW_READS 2            // reads filling the whole buffer in a row before growing
+#define BUF_SHRINK_READS 16         // reads using less than 1/4 buffer in a row before shrinking
+#define SOCK_BUF_FACTOR 2           // kernel socket buffer = io buffer size * factor
 #define MAX_EVENTS 4096
+#define ACCEPT_BUDGET 64            // max connections accepted per listen wakeup
+#define RELAY_BUDGET 262144         // max bytes relayed per connection wakeup, the rest waits its turn
 
 #define SERVER_ACCPECT 1
 #define SERVER_CONNECT_REMOTE 2
@@ -36,10 +48,102 @@
 #define CLOSE_BY_SOCKD 2
 #define CLOSE_BY_REMOTE 3
 
+#define RELAY_MODE_COPY 0           // recv into connection_t.buf, then send
+#define RELAY_MODE_SPLICE 1         // splice() socket -> pipe -> socket
+
+#define LISTEN_MODE_REUSEPORT 0     // one SO_REUSEPORT listen socket per worker
+#define LISTEN_MODE_SHARED 1        // one listen socket, EPOLLEXCLUSIVE in every worker
+
+#define BUF_POOL_SIZE 1024           // preallocated and cached io buffers per worker
+
+#define EVENT_BACKEND_EPOLL 0       // readiness: epoll + nonblocking recv/send
+#define EVENT_BACKEND_URING 1       // completion: io_uring, falls back to epoll
+
+#define URING_ENTRIES 4096          // submission queue size
+#define URING_BUF_NUM 1024          // provided buffers per worker, a power of 2
+#define URING_BUF_SIZE 16384
+
+#define CONNECT_TIMEOUT 10          // s, from accept until the remote is connected
+#define IDLE_TIMEOUT 300            // s, without data in both directions
+#define MAX_LIFETIME 0              // s, 0: unlimited
+
+#define CONNECT_ATTEMPT_MS 2000     // deadline of one remote connect attempt
+#define CONNECT_STAGGER_MS 300      // a pending attempt gets a parallel one after this, 0: one at a time
+#define CONNECT_RETRIES 2           // attempts after the first one, within the connect timeout
+#define CONNECT_ATTEMPTS_MAX 4      // attempts in flight of a session
+
+#define MAX_BACKENDS 64
+#define MAX_BACKEND_WEIGHT 100
+
+#define BALANCE_RR 0                // round robin
+#define BALANCE_WRR 1               // smooth weighted round robin
+#define BALANCE_LC 2                // least connections, by sessions / weight
+#define BALANCE_P2C 3               // the less loaded of two random backends
+#define BALANCE_HASH 4              // consistent hash of the client address
+
+#define UPSTREAM_REFILL_MS 1000     // pool size adjust period, and retry delay after a failed connect
+
+#define HEALTH_INTERVAL 2000        // ms between tcp connect probes of a backend
+#define HEALTH_TIMEOUT 1000         // ms, a probe not connected by then failed
+#define HEALTH_RISE 2               // probes ok in a row to mark a down backend up
+#define HEALTH_FALL 3               // probes failed in a row to mark an up backend down
+
+#define DNS_MAX_ADDRS 8             // A records kept per name
+#define DNS_MIN_TTL 5               // s, the ttl of answers is clamped to
+#define DNS_MAX_TTL 3600
+#define DNS_TIMEOUT_MS 2000         // a query not answered by then failed
+#define DNS_RETRY_MS 1000           // delay after a failed query, the stale addresses are kept
+#define DNS_POLL_MS 100             // without epoll, answers are read by the timer
+
+#define CIRCUIT_CLOSED 0            // sessions connect as usual
+#define CIRCUIT_OPEN 1              // no sessions, until the open time is over
+#define CIRCUIT_HALF_OPEN 2         // a few trial sessions decide to close or open again
+
+#define CIRCUIT_FAILURES 5          // failed or slow session connects in a row to open
+#define CIRCUIT_SLOW_MS 1000        // a connect slower than this counts as failed, 0: no limit
+#define CIRCUIT_OPEN_MS 5000        // open time, doubled for every failed half open, up to 16 times
+#define CIRCUIT_TRIALS 3            // trial connects of a half open circuit, all ok to close
+
+#define SOCK_PROFILE_DEFAULT 0      // kernel defaults
+#define SOCK_PROFILE_LATENCY 1      // interactive: nodelay, quickack, low unsent data
+#define SOCK_PROFILE_BULK 2         // throughput: coalesced segments, big kernel buffers
+
+#define SOCK_NOTSENT_LOWAT 16384    // latency: unsent bytes in the kernel before not writable
+#define SOCK_BULK_BUF_SIZE 1048576  // bulk: SO_RCVBUF and SO_SNDBUF, doubled by the kernel
+
+#define UDP_BATCH 64                // datagrams per recvmmsg/sendmmsg
+#define UDP_BATCH_ROUNDS 8          // recvmmsg per wakeup of a socket, level triggered for the rest
+#define UDP_DGRAM_SIZE 65536        // recv buffer of one datagram
+#define UDP_IDLE_TIMEOUT 30         // s, a flow without datagrams both ways is closed
+#define UDP_MAX_FLOWS 65536         // per worker, datagrams of new clients are dropped above
+#define UDP_SOCK_BUF_SIZE 4194304   // SO_RCVBUF and SO_SNDBUF of the listen socket, SO_RCVBUF of a flow
+#define UDP_GSO_MAX_SEGS 64         // datagrams of one UDP_SEGMENT send, the kernel limit
+#define UDP_GSO_MAX_BYTES 65507     // payload of one UDP_SEGMENT send, 64k less the ip and udp headers
+
+#define UDP_MODE_PLAIN 0            // a syscall per datagram
+#define UDP_MODE_MMSG 1             // recvmmsg/sendmmsg batches
+#define UDP_MODE_GSO 2              // batches, and same sized datagrams as one UDP_GRO/UDP_SEGMENT buffer
+
+#define STATS_NAME_LEN 64           // shm name of the live stats, -M
+
+#define PIPE_BUF_SIZE 65536
+#define PIPE_POOL_SIZE 1024
+
 typedef struct host_s host_t;
 typedef struct session_s session_t;
 typedef struct connection_s connection_t;
 typedef struct udp_connection_s udp_connection_t;
+typedef struct pipe_s pipe_t;
+typedef struct upstream_s upstream_t;
+typedef struct backend_conf_s backend_conf_t;
+typedef struct balancer_s balancer_t;
+typedef struct resolver_s resolver_t;
+typedef struct udp_relay_s udp_relay_t;
+typedef struct worker_stats_s worker_stats_t;
+typedef struct stats_shm_s stats_shm_t;
+typedef struct dns_entry_s dns_entry_t;
+typedef struct event_backend_s event_backend_t;
+typedef struct uring_s uring_t;
 typedef struct worker_process_s worker_process_t;
 typedef struct config_s config_t;
 
@@ -51,17 +155,80 @@ struct host_s
 };
 
 
+// kernel pipe used to splice data between two sockets without copy
+struct pipe_s
+{
+    int fds[2];                 // 0: read end, 1: write end
+    ssize_t size;               // pipe capacity
+    ssize_t data_length;        // bytes in pipe, not sent yet
+    list_node list_node;
+};
+
+struct backend_conf_s
+{
+    char host[DNS_NAME_LEN];
+    int port;
+    int weight;
+    int sock_profile;           // SOCK_PROFILE_* of the remote sockets
+};
+
+// a backend, with its pool of connected and idle sockets
+struct upstream_s
+{
+    struct sockaddr_in addr;
+    host_t host;
+    int index;                  // in process->upstreams
+    int weight;
+    int sock_profile;
+    dns_entry_t *dns;           // host is a name: its cached addresses, addr is the first one
+    unsigned int resolved:1;    // addr is valid
+    int active_num;             // sessions using it now
+    int heap_index;             // position in the least connections heap
+    unsigned long select_num;   // sessions sent to it
+
+    unsigned int down:1;        // failed health checks, not selected
+    int health_ok_num;          // probe results in a row
+    int health_fail_num;
+    connection_t *probe;        // probe connect in flight
+    long probe_stamp;
+    timer_node_t health_timer;
+
+    unsigned int circuit:2;     // CIRCUIT_*, from the session connects
+    int connect_fail_num;       // failed or slow connects in a row
+    int trial_num;              // half open: trial connects in flight
+    int trial_ok_num;
+    int reopen_num;             // half open failed in a row, backs off the open time
+    long connect_ms;            // moving average of connect time
+    unsigned long open_num;     // times the circuit opened
+    timer_node_t circuit_timer;
+
+    list_node idle_head;        // connection_t, newest first
+    int idle_num;
+    int connecting_num;         // pool connects in flight
+    int want_num;               // idle + connecting to keep, between pool min and max
+    int take_num;               // taken in this period, sizes the pool of the next one
+    long fail_stamp;            // last failed pool connect, no refill on use until the timer
+    timer_node_t timer;
+
+    unsigned long hit;          // sessions given a connected socket
+    unsigned long miss;         // sessions connecting by themselves
+};
+
 struct session_s
 {
     connection_t *client;         //client: data connection(tcp), tcp controller(udp)
     connection_t *remote;         //remote: tcp or udp socket
     udp_connection_t *udp_client;     //client: udp socket
     udp_connection_t *udp_remote;     //remote: udp socket
+    struct sockaddr_in udp_peer;    // udp flow: the client address, replies go to
+    session_t *flow_next;           // udp flow: next in the bucket of the flow table
 
 
+    long accept_stamp;          // stamp of accepted
     long connect_stamp;         // stamp of connected
     long close_stamp;           // stamp of closed
     long last_data_stamp;       // last stamp of data send or recv
+    long connect_us;            // us, monotonic, the first client bytes in and the connect started
 
     unsigned int up_byte_num;
     unsigned int down_byte_num;
@@ -70,12 +237,24 @@ struct session_s
     long session_id;
     rb_node_t rbtree_node;
     list_node list_node;
-
+    timer_node_t timer;         // earliest of connect, idle and lifetime deadline, re-armed lazily
+
+    // remote connect attempts, the first connected one is the remote
+    connection_t *attempts[CONNECT_ATTEMPTS_MAX];
+    int attempt_num;            // in flight
+    int attempt_total;          // started
+    unsigned long tried_mask;   // bit of upstream index % 64
+    long attempt_stamp;         // the last attempt started
+    upstream_t *last_upstream;  // of the last attempt, its next address is tried first
+    int addr_index;             // of last_upstream
+    timer_node_t connect_timer; // the next attempt deadline, or staggered start
 
     int err;
+    int uring_refs;             // io_uring requests in flight, freed at 0 once closed
     unsigned int stage:4;
     unsigned int closed:1;
     unsigned int closed_by:2;   // 1:client, 2:sockd, 3:remote
+    unsigned int replied:1;     // the remote sent its first byte
 
 } __attribute__((aligned(sizeof(long))));
 
@@ -83,13 +262,17 @@ struct session_s
 struct connection_s
 {    
     int fd;    
-    int events;
+    int events;                 // epoll interest registered, MOD skipped when unchanged
     void (*call_back)(worker_process_t *process, int fd, int events, void *arg);    
 
     unsigned int read:1;
     unsigned int write:1;
     unsigned int eof:1;
     unsigned int closed:1;
+    unsigned int local_resolved:1;  // local_host is valid
+    unsigned int connecting:1;      // remote only: connect in flight, reported to the circuit when done
+    unsigned int trial:1;           // the connect is a trial of a half open circuit
+    unsigned int ready:1;           // out of relay budget, in process->ready_head
 
     session_t *session;  
     connection_t* peer_conn;
@@ -97,9 +280,35 @@ struct connection_s
     host_t peer_host;
     host_t local_host;
 
-    ssize_t data_length; 
-    ssize_t sent_length; 
-    unsigned char buf[RECV_BUF_SIZE];
+    // ring buffer indexes, never wrapped: buf_tail - buf_head bytes are buffered,
+    // starting at buf[buf_head & (buf_size-1)]
+    size_t buf_head;            // next byte to send
+    size_t buf_tail;            // next byte to recv
+    pipe_t *pipe;               // data recv from this connection, for splice mode
+    upstream_t *upstream;       // remote only: where it is connected to
+    long connect_stamp;         // remote only: connect started
+    unsigned int syn_data_len;  // remote only: client bytes sent in the SYN, by fast open
+    int ready_events;           // out of relay budget: the events to resume with
+    list_node ready_node;       // in process->ready_head
+    list_node pool_node;        // idle in upstream->idle_head, no session yet, or closed and to free
+    unsigned char *buf;         // leased from buf_pools while holding data, else NULL
+    size_t buf_size;            // size of the leased buf, a power of 2
+
+    // adaptive size of the next leased buf, for the direction con -> peer
+    unsigned int buf_class;     // buf size is min_buf_size << buf_class
+    unsigned int full_read_num;
+    unsigned int small_read_num;
+    int sock_buf_size;          // largest SO_RCVBUF of con and SO_SNDBUF of peer tuned to, 0: untouched
+
+    unsigned long byte_num;     // bytes recv from con
+    unsigned long syscall_num;  // recv/send syscalls for the bytes
+
+    // io_uring backend: provided buffers recv from con, queued to send to peer
+    int send_head;              // buffer id, -1: empty
+    int send_tail;
+    unsigned int send_inflight;
+    unsigned int recv_armed:1;  // multishot recv in flight
+    list_node uring_node;       // waiting for free buffers to re-arm recv
 } __attribute__((aligned(sizeof(long))));
 
 
@@ -109,7 +318,13 @@ struct udp_connection_s
     int events;
     void (*call_back)(worker_process_t *process, int fd, int events, void *arg);
 
-     session_t *session;  
+    unsigned int read:1;
+    unsigned int write:1;
+    unsigned int eof:1;
+    unsigned int closed:1;
+
+    session_t *session;         // the flow of a remote socket, NULL for the listen socket
+    upstream_t *upstream;       // remote only
 } __attribute__((aligned(sizeof(long))));
 
 struct config_s
@@ -118,28 +333,113 @@ struct config_s
     struct in_addr outer_addr_cache;
     char listen_host[HOST_NAME_LEN];
     int listen_port;
-    char target_host[HOST_NAME_LEN];
+    char target_host[DNS_NAME_LEN];
     int target_port;
-    int udp_listen_port;
+    int udp_listen_port;        // 0: no udp relay
+    int udp_idle_timeout;       // s
+    int udp_max_flows;          // per worker
+    int udp_mode;               // UDP_MODE_*
     int listen_backlog;
+    int accept_budget;
+    int relay_budget;           // bytes, -1: no limit
     int max_sessions;
+    int connect_timeout;        // s
+    int connect_attempt_ms;
+    int connect_stagger_ms;
+    int connect_retries;
+    int idle_timeout;           // s
+    int max_lifetime;           // s, 0: unlimited
     
     int recv_buf_size;
     int send_buf_size;
+
+    int worker_num;
+    int listen_mode;
+
+    int buf_pool_size;
+    int min_buf_size;
+    int max_buf_size;
+    unsigned int sock_buf_tune;
+
+    backend_conf_t backends[MAX_BACKENDS];  // -t/-p when none given
+    int backend_num;
+    int balance_policy;
+    unsigned int health_check;
+    int health_interval;        // ms
+    int health_timeout;         // ms
+    int health_rise;
+    int health_fall;
+    unsigned int circuit_breaker;
+    int circuit_failures;
+    int circuit_slow_ms;
+    int circuit_open_ms;
+    int circuit_trials;
+    struct sockaddr_in resolver_addr;   // -R, else the first nameserver of resolv.conf
+    int upstream_pool_min;      // 0: no pool, connect on accept
+    int upstream_pool_max;
+
+    int event_backend;
+    int relay_mode;
+    int pipe_size;
+    int pipe_pool_size;
     
     unsigned int reuseaddr;
     unsigned int keepalive;
+    int fastopen_qlen;          // listen socket accepts data in the SYN, 0: off
+    unsigned int fastopen_connect;  // the first client bytes ride the SYN to the remote
+    int defer_accept;           // s, accept when the first data comes, 0: off
+    int client_sock_profile;    // SOCK_PROFILE_* of the accepted sockets
+    int backend_sock_profile;   // of the backends without their own
+    char stats_name[STATS_NAME_LEN];    // shared memory of the live stats, "": not exported
 } __attribute__((aligned(sizeof(long))));
 
 
+struct event_backend_s
+{
+    const char *name;
+    int (*init)(worker_process_t *process);     // listen socket is ready
+    int (*run)(worker_process_t *process);      // event loop, returns on fatal error
+    void (*done)(worker_process_t *process);
+    void (*close)(worker_process_t *process, session_t *session);
+};
+
 struct worker_process_s
 {
+    int worker_id;
+    event_backend_t *backend;
+    uring_t *uring;
     int epoll_fd;
     int listen_fd;
     int session_num;
     config_t* config;
     rb_root_t session_tree_root;
     list_node session_list_head;
+    list_node session_close_head;   // closed sessions, freed after the event batch
+    list_node conn_close_head;      // closed pool sockets and connect attempts, freed with them
+    list_node ready_head;           // connections out of relay budget, one more turn each after the batch
+    timer_wheel_t timer_wheel;
+    list_node pipe_free_head;
+    int pipe_free_num;
+    upstream_t *upstreams;          // config->backends
+    int upstream_num;
+    balancer_t *balancer;
+    resolver_t *resolver;           // backends given by name only
+    udp_relay_t *udp;               // -u only
+    stats_shm_t *stats_shm;         // all workers, shared with proxy_stat
+    worker_stats_t *stats;          // the slot of this worker
+    slab_pool_t session_pool;
+    slab_pool_t conn_pool;
+    slab_pool_t buf_pools[BUF_CLASS_NUM];   // io buffers, min_buf_size << index
+    unsigned long byte_num;
+    unsigned long syscall_num;
+    unsigned long relay_defer_num;      // wakeups cut by the relay budget
+    unsigned long connect_attempt_num;
+    unsigned long connect_fail_num;     // attempts failed, timed out included
+    unsigned long connect_timeout_num;  // attempts not connected by their deadline
+    unsigned long connect_retry_num;    // sessions connected by a retry
+    unsigned long connect_num;          // sessions connected
+    unsigned long fastopen_num;         // attempts carrying client bytes in the SYN
+    unsigned long fastopen_byte_num;
 } __attribute__((aligned(sizeof(long))));
 
 
@@ -155,4 +455,15 @@ session_t *create_session( worker_process_t *process, int fd);
 
 void close_session(worker_process_t *process, session_t *session);
 
+// the session is connected to its remote
+void count_connect( worker_process_t *process, session_t *session );
+
+// a connection closed out of a session, freed after the event batch
+void free_connection_later( worker_process_t *process, connection_t *con );
+
+void free_closed_sessions(worker_process_t *process);
+
+extern event_backend_t epoll_backend;
+extern volatile sig_atomic_t g_worker_exiting;     // SIGINT or SIGTERM, the event loop returns
+
 #endif /*SERVER_H_*/
\ No newline at end of file
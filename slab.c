@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <string.h>
+#include "slab.h"
+#include "log.h"
+
+int slab_init( slab_pool_t *pool, size_t obj_size, int prealloc_num )
+{
+    memset( pool, 0, sizeof(slab_pool_t) );
+
+    if( obj_size < sizeof(void *) )
+        obj_size = sizeof(void *);
+    pool->obj_size = (obj_size + sizeof(long) - 1) & ~(sizeof(long) - 1);
+
+    if( prealloc_num <= 0 )
+        return 0;
+
+    // pages are not touched until the objects are used
+    pool->chunk = (unsigned char *)malloc( pool->obj_size * prealloc_num );
+    if( pool->chunk == NULL ){
+        LOG_ERROR("slab prealloc failed, size:%zu, num:%d", pool->obj_size, prealloc_num );
+        return -1;
+    }
+    pool->chunk_next = pool->chunk;
+    pool->chunk_end = pool->chunk + pool->obj_size * prealloc_num;
+
+    return 0;
+}
+
+void *slab_alloc( slab_pool_t *pool )
+{
+    void *obj = pool->free_list;
+
+    if( obj != NULL ){
+        pool->free_list = *(void **)obj;
+        pool->free_num--;
+        pool->hit++;
+        return obj;
+    }
+
+    if( pool->chunk_next < pool->chunk_end ){
+        obj = pool->chunk_next;
+        pool->chunk_next += pool->obj_size;
+        pool->hit++;
+        return obj;
+    }
+
+    pool->miss++;
+    return malloc( pool->obj_size );
+}
+
+// objects from malloc are kept in the free list too, the pool grows to the peak,
+// unless max_free is set
+void slab_free( slab_pool_t *pool, void *obj )
+{
+    if( obj == NULL )
+        return;
+
+    if( pool->max_free > 0 && pool->free_num >= pool->max_free &&
+        ((unsigned char *)obj < pool->chunk || (unsigned char *)obj >= pool->chunk_end) ){
+        free( obj );
+        return;
+    }
+
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+    pool->free_num++;
+}
+
+void slab_destroy( slab_pool_t *pool )
+{
+    while( pool->free_list != NULL ){
+        unsigned char *obj = (unsigned char *)pool->free_list;
+        pool->free_list = *(void **)obj;
+        if( obj < pool->chunk || obj >= pool->chunk_end )
+            free( obj );
+    }
+
+    free( pool->chunk );
+    memset( pool, 0, sizeof(slab_pool_t) );
+}
@@ -0,0 +1,32 @@
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <stdlib.h>
+
+typedef struct slab_pool_s slab_pool_t;
+
+// fixed size object pool: one preallocated chunk, carved on demand,
+// and a free list linked through the first word of the free objects
+struct slab_pool_s
+{
+    size_t obj_size;
+    unsigned char *chunk;       // preallocated objects
+    unsigned char *chunk_end;
+    unsigned char *chunk_next;  // first never used object of chunk
+    void *free_list;
+    int free_num;
+    int max_free;               // 0: keep all, else malloc'ed objects beyond it are freed
+
+    unsigned long hit;          // served from chunk or free list
+    unsigned long miss;         // pool exhausted, served by malloc
+} __attribute__((aligned(sizeof(long))));
+
+int slab_init( slab_pool_t *pool, size_t obj_size, int prealloc_num );
+
+void *slab_alloc( slab_pool_t *pool );
+
+void slab_free( slab_pool_t *pool, void *obj );
+
+void slab_destroy( slab_pool_t *pool );
+
+#endif /*SLAB_H_*/
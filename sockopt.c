@@ -0,0 +1,45 @@
+#include <netinet/tcp.h>
+#include "sockopt.h"
+#include "log.h"
+
+static const char *g_sock_profile_names[] = { "default", "latency", "bulk" };
+
+int sock_profile_of_name( const char *name )
+{
+    int i;
+    for( i = SOCK_PROFILE_DEFAULT; i <= SOCK_PROFILE_BULK; i++ ){
+        if( strcmp( name, g_sock_profile_names[i] ) == 0 )
+            return i;
+    }
+    return -1;
+}
+
+const char *sock_profile_name( int profile )
+{
+    return g_sock_profile_names[profile];
+}
+
+static void _set_int_opt( int fd, int level, int name, int value, const char *opt )
+{
+    if( setsockopt( fd, level, name, (void *)&value, sizeof(int) ) < 0 )
+        DEBUG_INFO("set %s %d fail, fd:%d, %s", opt, value, fd, strerror(errno) );
+}
+
+void set_sock_profile( int fd, int profile )
+{
+    switch( profile ){
+        case SOCK_PROFILE_LATENCY:
+            _set_int_opt( fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY" );
+            // not sticky, the kernel may go back to delayed acks later
+            _set_int_opt( fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK" );
+            // writable only when little is unsent, the rest stays in our buffer
+            _set_int_opt( fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, SOCK_NOTSENT_LOWAT, "TCP_NOTSENT_LOWAT" );
+            break;
+        case SOCK_PROFILE_BULK:
+            // nagle and the kernel autocork merge the small writes into full segments.
+            // fixed buffers stop autotuning, and are kept by the buffer tuning of tcp.c
+            _set_int_opt( fd, SOL_SOCKET, SO_RCVBUF, SOCK_BULK_BUF_SIZE, "SO_RCVBUF" );
+            _set_int_opt( fd, SOL_SOCKET, SO_SNDBUF, SOCK_BULK_BUF_SIZE, "SO_SNDBUF" );
+            break;
+    }
+}
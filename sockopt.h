@@ -0,0 +1,16 @@
+#ifndef SOCKOPT_H_
+#define SOCKOPT_H_
+
+#include "server.h"
+
+// tcp options of a socket by the traffic it carries: latency sends small
+// writes at once and acks fast, bulk lets the kernel coalesce and keeps
+// big buffers. set on accepted client sockets and on remote sockets
+
+int sock_profile_of_name( const char *name );
+
+const char *sock_profile_name( int profile );
+
+void set_sock_profile( int fd, int profile );
+
+#endif /*SOCKOPT_H_*/
@@ -0,0 +1,92 @@
+#include <sys/mman.h>
+#include <time.h>
+#include "stats.h"
+#include "log.h"
+#include "utils.h"
+
+// stats_ticks() against the monotonic clock over a few ms
+static unsigned long _ticks_per_ms()
+{
+    long start_us = get_current_us();
+    unsigned long start = stats_ticks();
+    usleep( 20000 );
+    long us = get_current_us() - start_us;
+    return us > 0 ? (stats_ticks() - start) * 1000 / us : 1;
+}
+
+static size_t _stats_size( int worker_num )
+{
+    return sizeof(stats_shm_t) + worker_num * sizeof(worker_stats_t);
+}
+
+int init_stats( worker_process_t *process )
+{
+    config_t *config = process->config;
+    size_t size = _stats_size( config->worker_num );
+    stats_shm_t *shm = NULL;
+
+    if( config->stats_name[0] == '\0' )
+        snprintf( config->stats_name, STATS_NAME_LEN, "/proxy_server.%d", config->listen_port );
+
+    // a segment left by a crashed server is truncated to zeros and reused
+    int fd = shm_open( config->stats_name, O_CREAT|O_RDWR, 0644 );
+    if( fd >= 0 ){
+        if( ftruncate( fd, 0 ) == 0 && ftruncate( fd, size ) == 0 ){
+            shm = (stats_shm_t *)mmap( NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0 );
+            if( shm == MAP_FAILED )
+                shm = NULL;
+        }
+        close( fd );
+    }
+
+    // the counters are still kept, only not exported
+    if( shm == NULL ){
+        LOG_WARN("open stats shm %s fail, %s", config->stats_name, strerror(errno) );
+        config->stats_name[0] = '\0';
+        shm = (stats_shm_t *)calloc( 1, size );
+        if( shm == NULL )
+            return -1;
+    }
+
+    shm->version = STATS_VERSION;
+    shm->worker_num = config->worker_num;
+    shm->start_stamp = time( NULL );
+    shm->ticks_per_ms = _ticks_per_ms();
+    __atomic_store_n( &shm->magic, STATS_MAGIC, __ATOMIC_RELEASE );
+    process->stats_shm = shm;
+    return 0;
+}
+
+void attach_worker_stats( worker_process_t *process )
+{
+    worker_stats_t *stats = &process->stats_shm->workers[process->worker_id];
+
+    // a restarted worker goes on with the totals, its sessions died with it
+    stats->pid = getpid();
+    stats->session_num = 0;
+    process->stats = stats;
+}
+
+void destroy_stats( worker_process_t *process )
+{
+    config_t *config = process->config;
+
+    if( process->stats_shm == NULL )
+        return;
+    if( config->stats_name[0] ){
+        munmap( process->stats_shm, _stats_size( config->worker_num ) );
+        shm_unlink( config->stats_name );
+    }
+    else
+        free( process->stats_shm );
+    process->stats_shm = NULL;
+    process->stats = NULL;
+}
+
+void record_latency( worker_process_t *process, int hist, long start_us )
+{
+    if( start_us <= 0 )
+        return;
+    long us = get_current_us() - start_us;
+    hist_record( &process->stats->hists[hist], us > 0 ? us : 0 );
+}
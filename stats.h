@@ -0,0 +1,93 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include "server.h"
+#include "hist.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// live counters of the workers, in a shared memory segment read by proxy_stat.
+// each worker is the only writer of its own cache line, so no locks and no
+// atomic read-modify-write: the reader may see a counter one update late
+
+#define STATS_MAGIC 0x70737431      // "pst1"
+#define STATS_VERSION 3
+#define STATS_CACHE_LINE 64
+#define STATS_CLOSE_BY_NUM 4        // session closed_by: 0, CLOSE_BY_CLIENT, CLOSE_BY_SOCKD, CLOSE_BY_REMOTE
+
+// latency histograms in us, from the first client bytes in, when the connect starts
+#define STATS_HIST_CONNECT 0        // to the remote connected
+#define STATS_HIST_FIRST_BYTE 1     // to the first byte of the remote
+#define STATS_HIST_SESSION 2        // to the session closed
+#define STATS_HIST_NUM 3
+
+// event loop time by the callback of the event, the epoll backend only
+#define STATS_CB_ACCEPT 0           // accept_connect_cb
+#define STATS_CB_ACCEPT_DATA 1      // accpect_data_cb
+#define STATS_CB_CONNECT 2          // connect_remote_host_complete_cb
+#define STATS_CB_RELAY 3            // tcp_data_transform_et_cb
+#define STATS_CB_OTHER 4            // pool sockets, health checks, resolver, udp
+#define STATS_CB_BATCH_END 5        // after the events: relay budget queue, timers, frees
+#define STATS_CB_NUM 6
+
+struct worker_stats_s
+{
+    int pid;
+    long session_num;               // active sessions
+    unsigned long accept_num;
+    unsigned long up_byte_num;      // recv from clients
+    unsigned long down_byte_num;    // recv from backends
+    unsigned long connect_fail_num; // connect attempts failed, timed out included
+    unsigned long recv_eagain_num;
+    unsigned long send_eagain_num;
+    unsigned long close_num[STATS_CLOSE_BY_NUM];
+    hist_t hists[STATS_HIST_NUM];
+
+    // event loop, in stats_ticks(). busy and waiting near 1:0 is a saturated worker
+    unsigned long wait_ticks;       // blocked in epoll_wait or io_uring_enter
+    unsigned long busy_ticks;       // handling the events of the wakeups
+    unsigned long cb_num[STATS_CB_NUM];
+    unsigned long cb_ticks[STATS_CB_NUM];
+    hist_t batch_hist;              // events per wakeup
+} __attribute__((aligned(STATS_CACHE_LINE)));
+
+typedef struct stats_shm_s
+{
+    unsigned int magic;             // set last, when the segment is ready
+    unsigned int version;
+    int worker_num;
+    long start_stamp;               // s
+    unsigned long ticks_per_ms;     // of stats_ticks(), measured at start
+    worker_stats_t workers[0];
+} __attribute__((aligned(STATS_CACHE_LINE))) stats_shm_t;
+
+// plain load and store of the writer, never torn for the reader
+#define STATS_ADD( process, field, n ) \
+    __atomic_store_n( &(process)->stats->field, \
+        __atomic_load_n( &(process)->stats->field, __ATOMIC_RELAXED ) + (n), __ATOMIC_RELAXED )
+
+// the tsc, a few ns to read. elsewhere the monotonic clock in ns
+static inline unsigned long stats_ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+// the segment of config->stats_name for all workers, created before they fork
+int init_stats( worker_process_t *process );
+
+// the slot of process->worker_id
+void attach_worker_stats( worker_process_t *process );
+
+void destroy_stats( worker_process_t *process );
+
+// the time since start_us into the histogram, nothing when start_us is 0
+void record_latency( worker_process_t *process, int hist, long start_us );
+
+#endif /*STATS_H_*/
@@ -1,44 +1,179 @@
+#define _GNU_SOURCE
 #include "tcp.h"
+#include "stats.h"
 #include "log.h"
+#include "pipe.h"
+#include "utils.h"
 
-static int _recv ( connection_t *con, int size, int *err )
+// free space of the ring buffer, at most size bytes, split at the wrap point
+static int _buf_free_iov( connection_t *con, size_t size, struct iovec *iov )
+{
+    size_t tail = con->buf_tail & (con->buf_size-1);
+    size_t first = con->buf_size - tail;
+
+    iov[0].iov_base = con->buf + tail;
+    if( size <= first ){
+        iov[0].iov_len = size;
+        return 1;
+    }
+
+    iov[0].iov_len = first;
+    iov[1].iov_base = con->buf;
+    iov[1].iov_len = size - first;
+    return 2;
+}
+
+// buffered data of the ring buffer, split at the wrap point
+int buf_data_iov( connection_t *con, struct iovec *iov )
+{
+    size_t size = buf_data_length( con );
+    size_t head = con->buf_head & (con->buf_size-1);
+    size_t first = con->buf_size - head;
+
+    iov[0].iov_base = con->buf + head;
+    if( size <= first ){
+        iov[0].iov_len = size;
+        return 1;
+    }
+
+    iov[0].iov_len = first;
+    iov[1].iov_base = con->buf;
+    iov[1].iov_len = size - first;
+    return 2;
+}
+
+static unsigned int _buf_class_of_size( worker_process_t* process, size_t size )
+{
+    return __builtin_ctzl( size ) - __builtin_ctzl( process->config->min_buf_size );
+}
+
+// the kernel reports twice the value it was set with, -1 on error
+static int _sock_buf_of( int fd, int opt )
+{
+    int size = 0;
+    socklen_t len = sizeof(int);
+
+    if( getsockopt( fd, SOL_SOCKET, opt, (void *)&size, &len ) < 0 )
+        return -1;
+    return size / 2;
+}
+
+// raise kernel buffers of the direction con -> peer to follow the io buffer size.
+// a set buffer is out of kernel autotuning: one already as large is left alone,
+// and a shrinking io buffer keeps what the socket has
+static void _tune_sock_buf( worker_process_t* process, connection_t *con )
+{
+    connection_t *peer = con->peer_conn;
+    long want = ((long)process->config->min_buf_size << con->buf_class) * SOCK_BUF_FACTOR;
+    int size = want < INT_MAX ? (int)want : INT_MAX;
+    int cur;
+
+    if( !process->config->sock_buf_tune || con->fd <= 0 )
+        return;
+    if( size <= con->sock_buf_size )
+        return;
+
+    cur = _sock_buf_of( con->fd, SO_RCVBUF );
+    if( cur >= 0 && cur < size && setsockopt( con->fd, SOL_SOCKET, SO_RCVBUF, (void *)&size, sizeof(int) ) < 0 )
+        DEBUG_INFO("set SO_RCVBUF %d fail, fd:%d", size, con->fd );
+    if( peer && peer->fd > 0 ){
+        cur = _sock_buf_of( peer->fd, SO_SNDBUF );
+        if( cur >= 0 && cur < size && setsockopt( peer->fd, SOL_SOCKET, SO_SNDBUF, (void *)&size, sizeof(int) ) < 0 )
+            DEBUG_INFO("set SO_SNDBUF %d fail, fd:%d", size, peer->fd );
+    }
+    con->sock_buf_size = size;
+}
+
+// grow the buffer of a bulk direction, shrink it back when the reads get small.
+// the new size is used by the next lease, when the current buffer is drained
+static void _adapt_buf_size( worker_process_t* process, connection_t *con, size_t will_read, int len )
+{
+    unsigned int buf_class = con->buf_class;
+    unsigned int max_class = _buf_class_of_size( process, process->config->max_buf_size );
+
+    if( len == will_read && will_read == con->buf_size ){
+        con->small_read_num = 0;
+        if( ++con->full_read_num >= BUF_GROW_READS && buf_class < max_class ){
+            buf_class++;
+            con->full_read_num = 0;
+        }
+    }
+    else if( len*4 <= con->buf_size ){
+        con->full_read_num = 0;
+        if( ++con->small_read_num >= BUF_SHRINK_READS && buf_class > 0 ){
+            buf_class--;
+            con->small_read_num = 0;
+        }
+    }
+    else{
+        con->full_read_num = 0;
+        con->small_read_num = 0;
+    }
+
+    if( buf_class != con->buf_class ){
+        DEBUG_INFO("fd:%d buf size %d -> %d", con->fd, 
+            process->config->min_buf_size << con->buf_class, process->config->min_buf_size << buf_class );
+        con->buf_class = buf_class;
+        _tune_sock_buf( process, con );
+    }
+}
+
+// an empty buffer goes back to the pool at once, idle connections hold no buffer
+static void _release_empty_buf( worker_process_t* process, connection_t *con )
+{
+    if( con->buf && buf_data_length( con ) == 0 )
+        clean_recv_buf( process, con );
+}
+
+static int _recv ( worker_process_t* process, connection_t *con, int size, int *err )
 {
     int total = 0;  
+    struct iovec iov[2];
 
-    if (con->data_length > con->sent_length && con->sent_length > 0){
-        int unsent_len = con->data_length - con ->sent_length;
-        memmove(con->buf, con->buf + con->sent_length, unsent_len);
-        con->data_length = unsent_len;
-        con->sent_length = 0;
-        memset(con->buf + con->data_length, 0, RECV_BUF_SIZE - con->data_length);
-        size = RECV_BUF_SIZE - con->data_length;
+    // lease a buffer only when there is something to store
+    if( con->buf == NULL ){
+        con->buf = (unsigned char *)slab_alloc( &process->buf_pools[con->buf_class] );
+        if( con->buf == NULL ){
+            DEBUG_INFO("no memory for recv buf, fd: %d", con->fd );
+            return 0;
+        }
+        con->buf_size = process->config->min_buf_size << con->buf_class;
     }
-    
-    if( con->data_length >= RECV_BUF_SIZE ){
-        DEBUG_INFO("buf full,no recv, fd: %d, dlen:%d, slen:%d, expect:%d, recv:%d", 
-            con->fd, con->data_length, con->sent_length,  size, total );
+
+    // rewind an empty ring, so that the next read is not split
+    if( con->buf_head == con->buf_tail )
+        con->buf_head = con->buf_tail = 0;
+
+    size_t free_len = con->buf_size - buf_data_length( con );
+    if( free_len == 0 ){
+        DEBUG_INFO("buf full,no recv, fd: %d, head:%zu, tail:%zu, expect:%d, recv:%d", 
+            con->fd, con->buf_head, con->buf_tail,  size, total );
         return 0;
     }
 
     do{
-        int will_read = size;
-        if( con->data_length+size >RECV_BUF_SIZE ){
-            will_read = RECV_BUF_SIZE - con->data_length;
+        size_t will_read = size;
+        if( will_read > free_len ){
+            will_read = free_len;
         }
-        if( will_read <=0 ){
-            DEBUG_INFO("recv size error, fd: %d, dlen:%d, slen:%d, expect:%d, recv:%d", 
-                con->fd, con->data_length, con->sent_length,  size, total );
+        if( size <=0 ){
+            DEBUG_INFO("recv size error, fd: %d, head:%zu, tail:%zu, expect:%d, recv:%d", 
+                con->fd, con->buf_head, con->buf_tail,  size, total );
             return 0;
         }
 
-        int len = recv(con->fd, &con->buf[con->data_length], will_read, MSG_DONTWAIT ); //MSG_WAITALL
+        int iovcnt = _buf_free_iov( con, will_read, iov );
+        int len = readv(con->fd, iov, iovcnt );
         DEBUG_INFO("fd:%d recv data len: %d", con->fd, len);
         con->session->last_data_stamp = get_sys_ms();
+        con->syscall_num++;
 
         if (len > 0)
         {
-            con->data_length += len;
+            con->buf_tail += len;
+            con->byte_num += len;
             total += len;
+            _adapt_buf_size( process, con, will_read, len );
             return total;
         }
         else if( len < 0 )
@@ -46,28 +181,31 @@ static int _recv ( connection_t *con, int size, int *err )
             *err = errno;
             if (*err == EAGAIN)
             {   
-                DEBUG_INFO("recv EAGAIN : fd: %d, dlen:%d, slen:%d, expect:%d, recv:%d", 
-                    con->fd, con->data_length, con->sent_length, size, total );
+                DEBUG_INFO("recv EAGAIN : fd: %d, head:%zu, tail:%zu, expect:%d, recv:%d", 
+                    con->fd, con->buf_head, con->buf_tail, size, total );
+                _release_empty_buf( process, con );
                 break;
             }
 
             else if (*err == EINTR )
             {
-                DEBUG_INFO("recv EINTR : fd: %d, dlen:%d, slen:%d, expect:%d, recv:%d", 
-                    con->fd, con->data_length, con->sent_length, size, total );
+                DEBUG_INFO("recv EINTR : fd: %d, head:%zu, tail:%zu, expect:%d, recv:%d", 
+                    con->fd, con->buf_head, con->buf_tail, size, total );
                 continue;
             }
             else
             {
-                DEBUG_INFO("recv error:%d, %s. fd: %d, dlen:%d, slen:%d, expect:%d, recv:%d", 
-                    *err, strerror(*err), con->fd, con->data_length, con->sent_length, size, total );
+                DEBUG_INFO("recv error:%d, %s. fd: %d, head:%zu, tail:%zu, expect:%d, recv:%d", 
+                    *err, strerror(*err), con->fd, con->buf_head, con->buf_tail, size, total );
+                _release_empty_buf( process, con );
                 return -1;
             }
         }
         else if( len == 0 ){ 
-            DEBUG_INFO("eof. recv eof. fd:%d, dlen:%d, slen:%d, expect:%d, recv:%d",
-                con->fd, con->data_length, con->sent_length, size, total );
+            DEBUG_INFO("eof. recv eof. fd:%d, head:%zu, tail:%zu, expect:%d, recv:%d",
+                con->fd, con->buf_head, con->buf_tail, size, total );
             con->eof = 1;
+            _release_empty_buf( process, con );
             return -1;
         }
 
@@ -81,36 +219,38 @@ static int _recv ( connection_t *con, int size, int *err )
 static int _send( connection_t *con, int send_fd, int *err )
 {
     int total = 0;  
+    struct iovec iov[2];
     // will send size 
-    int size = con->data_length-con->sent_length;
-    if( size <=0 | size+con->sent_length>RECV_BUF_SIZE|| con->sent_length < 0 || 
-        con->sent_length >=RECV_BUF_SIZE || con->data_length<=0 || con->data_length>RECV_BUF_SIZE ){
-        DEBUG_INFO("buf error, fd:%d, send_fd: %d, dlen:%d, slen:%d", con->fd, send_fd, 
-            con->data_length, con->sent_length );
+    size_t size = buf_data_length( con );
+    if( size == 0 || size > con->buf_size ){
+        DEBUG_INFO("buf error, fd:%d, send_fd: %d, head:%zu, tail:%zu", con->fd, send_fd, 
+            con->buf_head, con->buf_tail );
         return -1;
     }
     
+    int iovcnt = buf_data_iov( con, iov );
     do{
-        int len = send(send_fd, &con->buf[con->sent_length], size, MSG_DONTWAIT ); //MSG_WAITALL
+        int len = writev(send_fd, iov, iovcnt );
         DEBUG_INFO("fd:%d send data len: %d", send_fd, len);
         con->session->last_data_stamp = get_sys_ms();
+        con->syscall_num++;
         if (len > 0)
         {
-            con->sent_length += len;
+            con->buf_head += len;
             total += len;
             return total;
         }
         else if( len == 0 ){ 
-            DEBUG_INFO("net disconnected when send data. fd: %d, dlen:%d, slen:%d, size:%d", 
-                send_fd, con->data_length, con->sent_length, size );
+            DEBUG_INFO("net disconnected when send data. fd: %d, head:%zu, tail:%zu, size:%zu", 
+                send_fd, con->buf_head, con->buf_tail, size );
             return -1;
         }
         else{
             *err = errno;
             if (*err == EAGAIN)
             {
-                DEBUG_INFO("send EAGAIN, fd: %d, dlen:%d, size:%d, %s", 
-                    send_fd, con->data_length, size, strerror(errno)  );
+                DEBUG_INFO("send EAGAIN, fd: %d, size:%zu, %s", 
+                    send_fd, size, strerror(errno)  );
                 break;
             }
 
@@ -127,31 +267,137 @@ static int _send( connection_t *con, int send_fd, int *err )
     while( 1 );
     
     
-    return con->sent_length;
+    return total;
 
 }
 
+// move data from socket into the pipe of con, no copy to user space
+static int _splice_recv( connection_t *con, int *err )
+{
+    pipe_t *pipe = con->pipe;
+    ssize_t size = pipe->size - pipe->data_length;
+
+    if( size <= 0 ){
+        DEBUG_INFO("pipe full,no recv, fd: %d, plen:%zd", con->fd, pipe->data_length );
+        return 0;
+    }
+
+    do{
+        ssize_t len = splice( con->fd, NULL, pipe->fds[1], NULL, size, SPLICE_F_MOVE|SPLICE_F_NONBLOCK );
+        DEBUG_INFO("fd:%d splice recv len: %zd", con->fd, len);
+        con->session->last_data_stamp = get_sys_ms();
+        con->syscall_num++;
+
+        if( len > 0 ){
+            pipe->data_length += len;
+            con->byte_num += len;
+            return len;
+        }
+        else if( len == 0 ){
+            DEBUG_INFO("eof. splice recv eof. fd:%d, plen:%zd", con->fd, pipe->data_length );
+            con->eof = 1;
+            return -1;
+        }
+
+        *err = errno;
+        if( *err == EAGAIN ){
+            // pipe slots may be used up before size bytes, retry after it drains
+            if( pipe->data_length > 0 )
+                *err = 0;
+            break;
+        }
+        if( *err == EINTR )
+            continue;
+
+        DEBUG_INFO("splice recv error:%d, %s. fd: %d, plen:%zd", *err, strerror(*err), con->fd, pipe->data_length );
+        return -1;
+    }
+    while( 1 );
+
+    return 0;
+}
+
+// move data from the pipe of con to send_fd
+static int _splice_send( connection_t *con, int send_fd, int *err )
+{
+    pipe_t *pipe = con->pipe;
+
+    do{
+        ssize_t len = splice( pipe->fds[0], NULL, send_fd, NULL, pipe->data_length, SPLICE_F_MOVE|SPLICE_F_NONBLOCK );
+        DEBUG_INFO("fd:%d splice send len: %zd", send_fd, len);
+        con->session->last_data_stamp = get_sys_ms();
+        con->syscall_num++;
+
+        if( len > 0 ){
+            pipe->data_length -= len;
+            return len;
+        }
+        else if( len == 0 ){
+            DEBUG_INFO("net disconnected when splice data. fd: %d, plen:%zd", send_fd, pipe->data_length );
+            return -1;
+        }
+
+        *err = errno;
+        if( *err == EAGAIN )
+            break;
+        if( *err == EINTR )
+            continue;
+
+        DEBUG_INFO("splice send error:%d, %s, fd: %d", *err, strerror(*err), send_fd );
+        return -1;
+    }
+    while( 1 );
+
+    return 0;
+}
+
 int recv_data(worker_process_t* process, connection_t *con, int up_direct, int* len)
 {
     if(!con->eof){
         *len = 0;
         int err = 0;
 
-        *len = _recv( con, RECV_BUF_SIZE-con->data_length, &err);
-        DEBUG_INFO("just only %s recv, fd:%d, dlen:%d, slen:%d", 
-            up_direct?"client":"remote", con->fd, con->data_length, con->sent_length );
+        // buffered data must be drained before switching to splice, to keep the order
+        if( con->pipe && buf_data_length( con ) == 0 ){
+            *len = _splice_recv( con, &err );
+            if( *len < 0 && err == EINVAL && con->pipe->data_length == 0 ){
+                // socket can not splice, fall back to buffered copy
+                DEBUG_INFO("splice not supported, fall back to copy, fd:%d", con->fd );
+                free_pipe( process, con->pipe );
+                con->pipe = NULL;
+                err = 0;
+                *len = _recv( process, con, process->config->max_buf_size, &err);
+            }
+        }
+        else
+            *len = _recv( process, con, process->config->max_buf_size, &err);
+        DEBUG_INFO("just only %s recv, fd:%d, head:%zu, tail:%zu", 
+            up_direct?"client":"remote", con->fd, con->buf_head, con->buf_tail );
 
         if( *len <0 || con->eof == 1) {
-            DEBUG_INFO("%s recv eof:%d, fd:%d, dlen:%d, slen:%d, len: %d, errno:%d, %s",
-                up_direct?"client":"remote", con->eof, con->fd, con->data_length, con->sent_length, *len, err, strerror(err) );
-            if( con->eof && con->data_length == 0){
+            DEBUG_INFO("%s recv eof:%d, fd:%d, head:%zu, tail:%zu, len: %d, errno:%d, %s",
+                up_direct?"client":"remote", con->eof, con->fd, con->buf_head, con->buf_tail, *len, err, strerror(err) );
+            if( con->eof && pending_length( con ) == 0){
                 con->session->err = err;
                 close_session( process, con->session);
             }
             return TCP_ERROR;
         }
 
+        if( *len > 0 ){
+            if( con == con->session->client )
+                STATS_ADD( process, up_byte_num, *len );
+            else{
+                STATS_ADD( process, down_byte_num, *len );
+                if( !con->session->replied ){
+                    con->session->replied = 1;
+                    record_latency( process, STATS_HIST_FIRST_BYTE, con->session->connect_us );
+                }
+            }
+        }
+
         if(err == EAGAIN){
+            STATS_ADD( process, recv_eagain_num, 1 );
             con->read = 0;
             return TCP_ABORT;
         }
@@ -161,12 +407,12 @@ int recv_data(worker_process_t* process, connection_t *con, int up_direct, int*
         }
     }
     else{
-        if (con->data_length == 0){
+        if (pending_length( con ) == 0){
             close_session( process, con->session);
         }
         else
-            DEBUG_INFO("recv eof, but remain data no sent %d, fd:%d", 
-                con->data_length - con->sent_length, con->fd);
+            DEBUG_INFO("recv eof, but remain data no sent %zd, fd:%d", 
+                pending_length( con ), con->fd);
 
         return TCP_ABORT;
     }
@@ -185,11 +431,14 @@ int send_data(worker_process_t* process, connection_t *con, int up_direct, int*
         return TCP_ERROR;
     }
 
-    if( con->data_length > con->sent_length ){
-        DEBUG_INFO("continue, send to %s , fd:%d, recv_fd:%d, dlen:%d, slen:%d", 
-            up_direct?"client":"remote", peer->fd, con->fd, con->data_length, con->sent_length);
+    if( pending_length( con ) > 0 ){
+        DEBUG_INFO("continue, send to %s , fd:%d, recv_fd:%d, head:%zu, tail:%zu", 
+            up_direct?"client":"remote", peer->fd, con->fd, con->buf_head, con->buf_tail);
         
-        *len = _send( con, peer->fd, &err );
+        if( buf_data_length( con ) > 0 )
+            *len = _send( con, peer->fd, &err );
+        else
+            *len = _splice_send( con, peer->fd, &err );
         if( *len < 0 ) {
             if( err == EPIPE || err == ECONNRESET){
                 peer->eof = 1;
@@ -197,20 +446,21 @@ int send_data(worker_process_t* process, connection_t *con, int up_direct, int*
                 close_session( process, con->session);
             }
             DEBUG_INFO( "%s send eof:%d, fd:%d, recv_fd:%d, len: %d, errno:%d, %s",
-                up_direct?"client":"remote", peer->eof, con->fd, peer->fd, con->data_length, con->sent_length, *len, errno, strerror(errno) );
+                up_direct?"client":"remote", peer->eof, con->fd, peer->fd, *len, errno, strerror(errno) );
             return TCP_ERROR;
         }
         
-        if( con->sent_length == con->data_length && con->data_length>0 ){
-            clean_recv_buf( con );
+        if( buf_data_length( con ) == 0 ){
+            clean_recv_buf( process, con );
         }
 
-        if (con->data_length == 0 && con->eof){
+        if (pending_length( con ) == 0 && con->eof){
             close_session( process, con->session );
             return TCP_ABORT;
         }
 
         if(err == EAGAIN){
+            STATS_ADD( process, send_eagain_num, 1 );
             peer->write = 0;
             return TCP_ABORT;
         }
@@ -222,21 +472,26 @@ int send_data(worker_process_t* process, connection_t *con, int up_direct, int*
     return TCP_OK;
 }
 
-void clean_recv_buf( connection_t *con )
+// give the buffer back to the pool, data not sent is dropped
+void clean_recv_buf( worker_process_t* process, connection_t *con )
 {
-    memset( con->buf, 0, RECV_BUF_SIZE );
-    con->data_length = 0;
-    con->sent_length = 0;
+    con->buf_head = 0;
+    con->buf_tail = 0;
+    if( con->buf ){
+        slab_free( &process->buf_pools[_buf_class_of_size( process, con->buf_size )], con->buf );
+        con->buf = NULL;
+        con->buf_size = 0;
+    }
 }
 
-int recv_data_until_length( connection_t *con, int length )
+int recv_data_until_length( worker_process_t* process, connection_t *con, int length )
 {
     int err = 0;
-    while( con->data_length < length)
+    while( buf_data_length( con ) < length)
     {
-        int len = _recv ( con, length-con->data_length, &err );
+        int len = _recv ( process, con, length-buf_data_length( con ), &err );
         if( len<=0 )
             break;
     }
-    return con->data_length;
+    return buf_data_length( con );
 }
\ No newline at end of file
@@ -7,7 +7,36 @@
 #define TCP_ABORT       -1
 #define TCP_ERROR       -2
 
-void clean_recv_buf( connection_t *con );
+// bytes buffered in con->buf, not sent to peer yet
+static inline size_t buf_data_length( connection_t *con )
+{
+    return con->buf_tail - con->buf_head;
+}
+
+// bytes recv from con and not sent to its peer, in buf or pipe
+static inline ssize_t pending_length( connection_t *con )
+{
+    ssize_t len = buf_data_length( con );
+    if( con->pipe )
+        len += con->pipe->data_length;
+    return len;
+}
+
+// no room to recv more from con until its peer takes some
+static inline int recv_buf_full( connection_t *con )
+{
+    // buffered data is drained before splicing again
+    if( buf_data_length( con ) > 0 )
+        return buf_data_length( con ) >= con->buf_size;
+    return con->pipe && con->pipe->data_length >= con->pipe->size;
+}
+
+// the buffered bytes as at most 2 iovecs, the ring may wrap
+int buf_data_iov( connection_t *con, struct iovec *iov );
+
+void clean_recv_buf( worker_process_t* process, connection_t *con );
+
+int recv_data_until_length( worker_process_t* process, connection_t *con, int length );
 
 int recv_data(worker_process_t* process, connection_t *con, int up_direct, int* len);
 
@@ -0,0 +1,145 @@
+#include <stddef.h>
+#include "timer.h"
+
+#define TIMER_MAX_TICKS (1UL << (TIMER_LEVEL_BITS * TIMER_LEVEL_NUM))
+
+static void _timer_link( timer_wheel_t *wheel, timer_node_t *timer )
+{
+    // already due: the next tick, never the one being expired
+    if( (long)(timer->expire - wheel->tick) < 0 )
+        timer->expire = wheel->tick;
+
+    unsigned long delta = timer->expire - wheel->tick;
+    if( delta >= TIMER_MAX_TICKS ){
+        delta = TIMER_MAX_TICKS - 1;
+        timer->expire = wheel->tick + delta;
+    }
+
+    int level = 0;
+    while( delta >= (1UL << (TIMER_LEVEL_BITS * (level+1))) )
+        level++;
+
+    int slot = (timer->expire >> (TIMER_LEVEL_BITS * level)) & TIMER_SLOT_MASK;
+    list_add_tail( &timer->list_node, &wheel->slots[level][slot] );
+}
+
+// move the timers of a slot to the lower levels, they are closer now
+static void _timer_cascade( timer_wheel_t *wheel, int level, int slot )
+{
+    list_node list;
+    list_node *head = &wheel->slots[level][slot];
+    if( list_empty( head ) )
+        return;
+
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    INIT_LIST_HEAD( head );
+
+    while( !list_empty( &list ) ){
+        timer_node_t *timer = list_entry( list.next, timer_node_t, list_node );
+        list_del( &timer->list_node );
+        _timer_link( wheel, timer );
+    }
+}
+
+void timer_wheel_init( timer_wheel_t *wheel, long now_ms )
+{
+    int i, j;
+    for( i = 0; i < TIMER_LEVEL_NUM; i++ ){
+        for( j = 0; j < TIMER_SLOT_NUM; j++ )
+            INIT_LIST_HEAD( &wheel->slots[i][j] );
+    }
+    wheel->tick = now_ms / TIMER_TICK_MS;
+    wheel->timer_num = 0;
+}
+
+void timer_add( timer_wheel_t *wheel, timer_node_t *timer, long expire_ms )
+{
+    if( timer->pending )
+        timer_del( wheel, timer );
+
+    // round up, a timer never fires early
+    timer->expire = (expire_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    _timer_link( wheel, timer );
+    timer->pending = 1;
+    wheel->timer_num++;
+}
+
+void timer_del( timer_wheel_t *wheel, timer_node_t *timer )
+{
+    if( !timer->pending )
+        return;
+
+    list_del( &timer->list_node );
+    timer->pending = 0;
+    wheel->timer_num--;
+}
+
+void timer_expire( timer_wheel_t *wheel, long now_ms, void *arg )
+{
+    unsigned long now = now_ms / TIMER_TICK_MS;
+    list_node list;
+
+    while( (long)(now - wheel->tick) >= 0 ){
+        if( wheel->timer_num == 0 ){
+            wheel->tick = now + 1;
+            break;
+        }
+
+        int slot = wheel->tick & TIMER_SLOT_MASK;
+        if( slot == 0 ){
+            int level;
+            for( level = 1; level < TIMER_LEVEL_NUM; level++ ){
+                int index = (wheel->tick >> (TIMER_LEVEL_BITS * level)) & TIMER_SLOT_MASK;
+                _timer_cascade( wheel, level, index );
+                if( index != 0 )
+                    break;
+            }
+        }
+
+        // handlers may re-arm, and land on the next tick at the earliest
+        list_node *head = &wheel->slots[0][slot];
+        wheel->tick++;
+        if( list_empty( head ) )
+            continue;
+
+        list.next = head->next;
+        list.prev = head->prev;
+        list.next->prev = &list;
+        list.prev->next = &list;
+        INIT_LIST_HEAD( head );
+
+        while( !list_empty( &list ) ){
+            timer_node_t *timer = list_entry( list.next, timer_node_t, list_node );
+            list_del( &timer->list_node );
+            timer->pending = 0;
+            wheel->timer_num--;
+            timer->handler( timer, arg );
+        }
+    }
+}
+
+int timer_next_timeout( timer_wheel_t *wheel, long now_ms, int max_ms )
+{
+    if( wheel->timer_num == 0 )
+        return max_ms;
+
+    // the first non-empty level 0 slot, or the next cascade
+    unsigned long tick = wheel->tick;
+    int i;
+    for( i = 0; i < TIMER_SLOT_NUM; i++, tick++ ){
+        if( i > 0 && (tick & TIMER_SLOT_MASK) == 0 )
+            break;
+        if( !list_empty( &wheel->slots[0][tick & TIMER_SLOT_MASK] ) )
+            break;
+    }
+
+    long timeout = (long)tick * TIMER_TICK_MS - now_ms;
+    if( timeout < 0 )
+        return 0;
+    if( timeout > max_ms )
+        return max_ms;
+    return timeout;
+}
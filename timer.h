@@ -0,0 +1,47 @@
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include "list.h"
+
+#define TIMER_TICK_MS 100           // resolution of the wheel
+#define TIMER_LEVEL_BITS 6
+#define TIMER_LEVEL_NUM 4           // 64^4 ticks, about 19 days, longer timers are clamped
+#define TIMER_SLOT_NUM (1 << TIMER_LEVEL_BITS)
+#define TIMER_SLOT_MASK (TIMER_SLOT_NUM - 1)
+
+typedef struct timer_node_s timer_node_t;
+typedef struct timer_wheel_s timer_wheel_t;
+
+// embedded in the owner, the owner is found back by list_entry()
+struct timer_node_s
+{
+    list_node list_node;
+    unsigned long expire;       // in ticks
+    void (*handler)(timer_node_t *timer, void *arg);
+    unsigned int pending:1;     // linked in a slot
+};
+
+// hierarchical timer wheel: a timer sits in level 0 when it expires in the
+// next 64 ticks, else in the level of its distance, and cascades one level
+// down each time the lower level wraps. add, del and expire are O(1)
+struct timer_wheel_s
+{
+    unsigned long tick;         // next tick to expire
+    int timer_num;
+    list_node slots[TIMER_LEVEL_NUM][TIMER_SLOT_NUM];
+};
+
+void timer_wheel_init( timer_wheel_t *wheel, long now_ms );
+
+// (re)arm timer to expire at expire_ms
+void timer_add( timer_wheel_t *wheel, timer_node_t *timer, long expire_ms );
+
+void timer_del( timer_wheel_t *wheel, timer_node_t *timer );
+
+// run the handlers of the timers expired up to now_ms, with arg
+void timer_expire( timer_wheel_t *wheel, long now_ms, void *arg );
+
+// ms until the next timer may expire, at most max_ms; for the poll timeout
+int timer_next_timeout( timer_wheel_t *wheel, long now_ms, int max_ms );
+
+#endif /*TIMER_H_*/
@@ -0,0 +1,511 @@
+#define _GNU_SOURCE
+#include <netinet/udp.h>
+#include "udp.h"
+#include "balance.h"
+#include "log.h"
+#include "utils.h"
+
+struct udp_relay_s
+{
+    udp_connection_t listen;        // reuseport: the kernel keeps a client on one worker
+    session_t **buckets;            // flows by client address, chained by flow_next
+    unsigned int bucket_mask;
+    int flow_num;
+    int mode;                       // UDP_MODE_*
+    int batch;                      // messages per recvmmsg, 1 in plain mode
+
+    // one batch of datagrams, recv from a socket and sent on another. in gso
+    // mode a message is the datagrams of a gro buffer, of segs bytes each
+    unsigned char *bufs;            // UDP_BATCH of UDP_DGRAM_SIZE
+    struct mmsghdr recv_msgs[UDP_BATCH];
+    struct iovec recv_iovs[UDP_BATCH];
+    struct sockaddr_in addrs[UDP_BATCH];
+    char recv_ctrls[UDP_BATCH][CMSG_SPACE(sizeof(int))];
+    unsigned int segs[UDP_BATCH];   // 0: a single datagram
+    struct mmsghdr send_msgs[UDP_BATCH];
+    struct iovec send_iovs[UDP_BATCH];
+    char send_ctrls[UDP_BATCH][CMSG_SPACE(sizeof(unsigned short))];
+
+    unsigned long flow_total;
+    unsigned long expire_num;
+    unsigned long up_num;           // datagrams sent to the backends
+    unsigned long down_num;         // to the clients
+    unsigned long up_byte_num;
+    unsigned long down_byte_num;
+    unsigned long drop_num;         // truncated, no flow for it, or socket full
+    unsigned long syscall_num;
+    unsigned long gro_num;          // buffers recv of more than one datagram
+    unsigned long gso_num;          // sends of more than one datagram
+};
+
+static const char *g_udp_mode_names[] = { "plain", "mmsg", "gso" };
+
+int udp_mode_of_name( const char *name )
+{
+    int i;
+    for( i = UDP_MODE_PLAIN; i <= UDP_MODE_GSO; i++ ){
+        if( strcmp( name, g_udp_mode_names[i] ) == 0 )
+            return i;
+    }
+    return -1;
+}
+
+// murmur3 finalizer of the address and port
+static unsigned int _flow_hash( struct sockaddr_in *addr )
+{
+    unsigned int h = ntohl( addr->sin_addr.s_addr ) ^ ((unsigned int)ntohs( addr->sin_port ) << 16 | ntohs( addr->sin_port ));
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static int _same_addr( struct sockaddr_in *a, struct sockaddr_in *b )
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+// the link to the flow of addr, to NULL when none
+static session_t **_flow_slot( udp_relay_t *relay, struct sockaddr_in *addr )
+{
+    session_t **slot = &relay->buckets[_flow_hash( addr ) & relay->bucket_mask];
+    while( *slot && !_same_addr( &(*slot)->udp_peer, addr ) )
+        slot = &(*slot)->flow_next;
+    return slot;
+}
+
+// the segment size of a gro buffer, 0 when it holds one datagram
+static unsigned int _gro_size( struct msghdr *hdr )
+{
+    struct cmsghdr *cmsg;
+    for( cmsg = CMSG_FIRSTHDR( hdr ); cmsg; cmsg = CMSG_NXTHDR( hdr, cmsg ) ){
+        if( cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO )
+            return *(int *)CMSG_DATA( cmsg );
+    }
+    return 0;
+}
+
+// datagrams of the message i of the batch
+static int _dgram_num( udp_relay_t *relay, int i )
+{
+    unsigned int len = relay->recv_msgs[i].msg_len;
+    unsigned int seg = relay->segs[i];
+    return seg && len > seg ? (len + seg - 1) / seg : 1;
+}
+
+static int _recv_batch( udp_relay_t *relay, int fd )
+{
+    int i, n;
+    for( i = 0; i < relay->batch; i++ ){
+        relay->recv_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        if( relay->mode == UDP_MODE_GSO )
+            relay->recv_msgs[i].msg_hdr.msg_controllen = sizeof(relay->recv_ctrls[i]);
+    }
+
+    do{
+        n = recvmmsg( fd, relay->recv_msgs, relay->batch, MSG_DONTWAIT, NULL );
+        relay->syscall_num++;
+    }
+    while( n < 0 && errno == EINTR );
+
+    for( i = 0; i < n; i++ ){
+        relay->segs[i] = relay->mode == UDP_MODE_GSO ? _gro_size( &relay->recv_msgs[i].msg_hdr ) : 0;
+        if( relay->segs[i] && relay->recv_msgs[i].msg_len > relay->segs[i] )
+            relay->gro_num++;
+    }
+    return n;
+}
+
+// the segment size of a send of several datagrams
+static void _set_gso_size( struct msghdr *hdr, char *ctrl, unsigned short seg )
+{
+    hdr->msg_control = ctrl;
+    hdr->msg_controllen = CMSG_SPACE(sizeof(unsigned short));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR( hdr );
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned short));
+    *(unsigned short *)CMSG_DATA( cmsg ) = seg;
+}
+
+// the datagrams of a flow in a row come as one buffer
+static int _set_gro( int fd )
+{
+    int value = 1;
+    if( setsockopt( fd, SOL_UDP, UDP_GRO, (void *)&value, sizeof(int) ) < 0 ){
+        DEBUG_INFO("set UDP_GRO fail, fd:%d, %s", fd, strerror(errno) );
+        return -1;
+    }
+    return 0;
+}
+
+// send the messages [from, to) of the batch on fd, to addr or the connected
+// peer. in gso mode the datagrams of a size in a row go as one send of
+// UDP_SEGMENT. the ones the socket can not take are dropped. the datagrams
+// sent, -1 on a socket error
+static int _send_batch( udp_relay_t *relay, int fd, int from, int to, struct sockaddr_in *addr, unsigned long *byte_num )
+{
+    int dgrams[UDP_BATCH];
+    int num = 0, iov_num = 0, sent = 0, dgram_num = 0, drop = 0, i;
+    unsigned int seg = 0, len = 0;
+
+    for( i = from; i < to; i++ ){
+        unsigned int msg_len = relay->recv_msgs[i].msg_len;
+        unsigned int msg_seg = relay->segs[i] ? relay->segs[i] : msg_len;
+        if( relay->recv_msgs[i].msg_hdr.msg_flags & MSG_TRUNC ){
+            drop += _dgram_num( relay, i );
+            continue;
+        }
+
+        relay->send_iovs[iov_num].iov_base = relay->recv_iovs[i].iov_base;
+        relay->send_iovs[iov_num].iov_len = msg_len;
+
+        // only the last segment of a send may be short
+        if( relay->mode == UDP_MODE_GSO && num > 0 && msg_seg == seg && seg > 0 && len % seg == 0 &&
+            len + msg_len <= UDP_GSO_MAX_BYTES && dgrams[num-1] + _dgram_num( relay, i ) <= UDP_GSO_MAX_SEGS ){
+            relay->send_msgs[num-1].msg_hdr.msg_iovlen++;
+            dgrams[num-1] += _dgram_num( relay, i );
+            len += msg_len;
+            iov_num++;
+            continue;
+        }
+
+        struct msghdr *hdr = &relay->send_msgs[num].msg_hdr;
+        hdr->msg_iov = &relay->send_iovs[iov_num];
+        hdr->msg_iovlen = 1;
+        hdr->msg_name = addr;
+        hdr->msg_namelen = addr ? sizeof(struct sockaddr_in) : 0;
+        hdr->msg_control = NULL;
+        hdr->msg_controllen = 0;
+        dgrams[num] = _dgram_num( relay, i );
+        if( num > 0 && dgrams[num-1] > 1 )
+            _set_gso_size( &relay->send_msgs[num-1].msg_hdr, relay->send_ctrls[num-1], seg );
+        seg = msg_seg;
+        len = msg_len;
+        num++;
+        iov_num++;
+    }
+    if( num > 0 && dgrams[num-1] > 1 )
+        _set_gso_size( &relay->send_msgs[num-1].msg_hdr, relay->send_ctrls[num-1], seg );
+
+    while( sent < num ){
+        int ret = sendmmsg( fd, relay->send_msgs + sent, num - sent, 0 );
+        relay->syscall_num++;
+        if( ret < 0 ){
+            if( errno == EINTR )
+                continue;
+            // segments the path can not take, as past the mtu. dropped, the rest goes on
+            if( (errno == EINVAL || errno == EIO) && dgrams[sent] > 1 ){
+                DEBUG_INFO("udp gso send error, fd:%d, %s", fd, strerror(errno) );
+                drop += dgrams[sent];
+                dgrams[sent] = 0;
+                relay->send_msgs[sent++].msg_len = 0;
+                continue;
+            }
+            break;
+        }
+        sent += ret;
+    }
+
+    for( i = 0; i < num; i++ ){
+        if( i < sent ){
+            *byte_num += relay->send_msgs[i].msg_len;
+            dgram_num += dgrams[i];
+            if( dgrams[i] > 1 )
+                relay->gso_num++;
+        }
+        else
+            drop += dgrams[i];
+    }
+    relay->drop_num += drop;
+    return sent < num && errno != EAGAIN && errno != ENOBUFS ? -1 : dgram_num;
+}
+
+// datagrams of the backend, to the client of the flow
+static void _udp_remote_cb( worker_process_t *process, int fd, int events, void *arg )
+{
+    udp_connection_t *remote = (udp_connection_t *)arg;
+    session_t *session = remote->session;
+    udp_relay_t *relay = process->udp;
+    int round;
+
+    for( round = 0; round < UDP_BATCH_ROUNDS * UDP_BATCH / relay->batch; round++ ){
+        int n = _recv_batch( relay, fd );
+        if( n < 0 ){
+            // port unreachable of the backend, its next datagram opens a new flow
+            if( errno != EAGAIN ){
+                DEBUG_INFO("udp recv from backend error, fd:%d, %s", fd, strerror(errno) );
+                session->err = errno;
+                close_udp_flow( process, session );
+            }
+            return;
+        }
+
+        session->last_data_stamp = get_sys_ms();
+        int sent = _send_batch( relay, relay->listen.fd, 0, n, &session->udp_peer, &relay->down_byte_num );
+        if( sent < 0 ){
+            DEBUG_INFO("udp send to client error, fd:%d, %s", relay->listen.fd, strerror(errno) );
+            session->err = errno;
+            close_udp_flow( process, session );
+            return;
+        }
+        relay->down_num += sent;
+        if( n < relay->batch )
+            break;
+    }
+}
+
+static void _udp_flow_timer_cb( timer_node_t *timer, void *arg )
+{
+    worker_process_t *process = (worker_process_t *)arg;
+    session_t *session = list_entry( timer, session_t, timer );
+    long deadline = session->last_data_stamp + process->config->udp_idle_timeout * 1000L;
+
+    if( deadline > get_sys_ms() ){
+        timer_add( &process->timer_wheel, &session->timer, deadline );
+        return;
+    }
+    process->udp->expire_num++;
+    close_udp_flow( process, session );
+}
+
+// a flow to a backend selected for the client, NULL when none or too many
+static session_t *_open_flow( worker_process_t *process, struct sockaddr_in *addr, session_t **slot )
+{
+    udp_relay_t *relay = process->udp;
+    if( relay->flow_num >= process->config->udp_max_flows )
+        return NULL;
+
+    upstream_t *upstream = select_upstream( process, addr );
+    if( upstream == NULL )
+        return NULL;
+
+    // a udp_connection_t fits in a slot of the connection pool
+    session_t *session = (session_t *)slab_alloc( &process->session_pool );
+    udp_connection_t *remote = (udp_connection_t *)slab_alloc( &process->conn_pool );
+    int fd = socket( AF_INET, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0 );
+    if( session == NULL || remote == NULL || fd < 0 ||
+        connect( fd, (struct sockaddr *)&upstream->addr, sizeof(struct sockaddr_in) ) < 0 ){
+        DEBUG_INFO("open udp flow error, %s:%d, %s", upstream->host.hostname, upstream->host.port, strerror(errno) );
+        if( fd >= 0 )
+            close( fd );
+        if( remote )
+            slab_free( &process->conn_pool, remote );
+        if( session )
+            slab_free( &process->session_pool, session );
+        release_upstream( process, upstream );
+        return NULL;
+    }
+    memset( session, 0, sizeof(session_t) );
+    memset( remote, 0, sizeof(udp_connection_t) );
+
+    // a burst of answers waits here for the next wakeup, charged only while held
+    int size = UDP_SOCK_BUF_SIZE;
+    if( setsockopt( fd, SOL_SOCKET, SO_RCVBUF, (void *)&size, sizeof(int) ) < 0 )
+        DEBUG_INFO("set udp SO_RCVBUF fail, fd:%d", fd );
+    if( relay->mode == UDP_MODE_GSO )
+        _set_gro( fd );
+
+    remote->session = session;
+    remote->upstream = upstream;
+    session->udp_client = &relay->listen;
+    session->udp_remote = remote;
+    session->udp_peer = *addr;
+    session->stage = SERVER_DATA;
+    session->accept_stamp = get_sys_ms();
+    session->last_data_stamp = session->accept_stamp;
+    session->timer.handler = _udp_flow_timer_cb;
+    timer_add( &process->timer_wheel, &session->timer, session->accept_stamp + process->config->udp_idle_timeout * 1000L );
+
+    // the headers of udp_connection_t and connection_t are the same
+    register_session_event( process->epoll_fd, (connection_t *)remote, fd, EPOLLIN, _udp_remote_cb );
+
+    *slot = session;
+    relay->flow_num++;
+    relay->flow_total++;
+    return session;
+}
+
+// datagrams of the clients, to the backends of their flows. the ones of a
+// client in a row go in one sendmmsg
+static void _udp_listen_cb( worker_process_t *process, int fd, int events, void *arg )
+{
+    udp_relay_t *relay = process->udp;
+    int round;
+
+    for( round = 0; round < UDP_BATCH_ROUNDS * UDP_BATCH / relay->batch; round++ ){
+        int n = _recv_batch( relay, fd );
+        if( n < 0 ){
+            if( errno != EAGAIN )
+                LOG_WARN("udp recv error, fd:%d, %s", fd, strerror(errno) );
+            return;
+        }
+
+        int i = 0;
+        while( i < n ){
+            struct sockaddr_in *addr = &relay->addrs[i];
+            int j = i + 1;
+            while( j < n && _same_addr( &relay->addrs[j], addr ) )
+                j++;
+
+            session_t **slot = _flow_slot( relay, addr );
+            session_t *session = *slot ? *slot : _open_flow( process, addr, slot );
+            if( session == NULL ){
+                int k;
+                for( k = i; k < j; k++ )
+                    relay->drop_num += _dgram_num( relay, k );
+            }
+            else{
+                session->last_data_stamp = get_sys_ms();
+                int sent = _send_batch( relay, session->udp_remote->fd, i, j, NULL, &relay->up_byte_num );
+                if( sent < 0 ){
+                    DEBUG_INFO("udp send to backend error, fd:%d, %s", session->udp_remote->fd, strerror(errno) );
+                    session->err = errno;
+                    close_udp_flow( process, session );
+                }
+                else
+                    relay->up_num += sent;
+            }
+            i = j;
+        }
+
+        if( n < relay->batch )
+            break;
+    }
+}
+
+void close_udp_flow( worker_process_t *process, session_t *session )
+{
+    udp_relay_t *relay = process->udp;
+    udp_connection_t *remote = session->udp_remote;
+
+    if( session->closed )
+        return;
+    session->closed = 1;
+    session->close_stamp = get_sys_ms();
+
+    session_t **slot = _flow_slot( relay, &session->udp_peer );
+    if( *slot == session )
+        *slot = session->flow_next;
+    relay->flow_num--;
+
+    // events of this batch may still point to it, freed after the batch
+    remote->closed = 1;
+    epoll_ctl( process->epoll_fd, EPOLL_CTL_DEL, remote->fd, NULL );
+    close( remote->fd );
+    release_upstream( process, remote->upstream );
+    timer_del( &process->timer_wheel, &session->timer );
+    list_add_tail( &session->list_node, &process->session_close_head );
+}
+
+static int _open_listen_socket( worker_process_t *process, udp_relay_t *relay )
+{
+    config_t *config = process->config;
+    int value = 1;
+    int size = UDP_SOCK_BUF_SIZE;
+
+    int fd = socket( AF_INET, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0 );
+    if( fd < 0 ){
+        LOG_ERROR("open udp socket fail, %s", strerror(errno) );
+        return -1;
+    }
+
+    // every worker binds its own socket, a client address is hashed to one of them
+    if( setsockopt( fd, SOL_SOCKET, SO_REUSEPORT, (void *)&value, sizeof(int) ) < 0 )
+        LOG_WARN("set udp SO_REUSEPORT fail, fd:%d", fd );
+    if( setsockopt( fd, SOL_SOCKET, SO_RCVBUF, (void *)&size, sizeof(int) ) < 0 ||
+        setsockopt( fd, SOL_SOCKET, SO_SNDBUF, (void *)&size, sizeof(int) ) < 0 )
+        DEBUG_INFO("set udp socket buffers fail, fd:%d", fd );
+    if( relay->mode == UDP_MODE_GSO && _set_gro( fd ) < 0 ){
+        LOG_WARN("worker %d, udp gso/gro not supported, relay in mmsg mode", process->worker_id );
+        relay->mode = UDP_MODE_MMSG;
+    }
+
+    struct sockaddr_in sin;
+    memset( &sin, 0, sizeof(struct sockaddr_in) );
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = INADDR_ANY;
+    sin.sin_port = htons( config->udp_listen_port );
+    if( bind( fd, (struct sockaddr *)&sin, sizeof(sin) ) < 0 ){
+        LOG_ERROR("bind udp port:%d failed, %s", config->udp_listen_port, strerror(errno) );
+        close( fd );
+        return -1;
+    }
+
+    register_session_event( process->epoll_fd, (connection_t *)&relay->listen, fd, EPOLLIN, _udp_listen_cb );
+    return 0;
+}
+
+int init_udp_relay( worker_process_t *process )
+{
+    config_t *config = process->config;
+    int i;
+
+    if( config->udp_listen_port == 0 )
+        return 0;
+    if( process->epoll_fd <= 0 ){
+        LOG_WARN("worker %d, udp relay needs epoll, not started", process->worker_id );
+        return 0;
+    }
+
+    udp_relay_t *relay = (udp_relay_t *)calloc( 1, sizeof(udp_relay_t) );
+    if( relay == NULL )
+        return -1;
+    process->udp = relay;
+    relay->mode = config->udp_mode;
+    relay->batch = relay->mode == UDP_MODE_PLAIN ? 1 : UDP_BATCH;
+
+    unsigned int bucket_num = 1;
+    while( bucket_num < (unsigned int)config->udp_max_flows )
+        bucket_num <<= 1;
+    relay->buckets = (session_t **)calloc( bucket_num, sizeof(session_t *) );
+    relay->bucket_mask = bucket_num - 1;
+    relay->bufs = (unsigned char *)malloc( UDP_BATCH * UDP_DGRAM_SIZE );
+    if( relay->buckets == NULL || relay->bufs == NULL ){
+        LOG_ERROR("malloc udp relay error, flows: %d", config->udp_max_flows );
+        return -1;
+    }
+
+    for( i = 0; i < UDP_BATCH; i++ ){
+        struct msghdr *hdr = &relay->recv_msgs[i].msg_hdr;
+        relay->recv_iovs[i].iov_base = relay->bufs + i * UDP_DGRAM_SIZE;
+        relay->recv_iovs[i].iov_len = UDP_DGRAM_SIZE;
+        hdr->msg_iov = &relay->recv_iovs[i];
+        hdr->msg_iovlen = 1;
+        hdr->msg_name = &relay->addrs[i];
+        hdr->msg_control = relay->recv_ctrls[i];
+    }
+
+    return _open_listen_socket( process, relay );
+}
+
+void destroy_udp_relay( worker_process_t *process )
+{
+    udp_relay_t *relay = process->udp;
+    unsigned int i;
+
+    if( relay == NULL )
+        return;
+
+    for( i = 0; relay->buckets && i <= relay->bucket_mask; i++ ){
+        while( relay->buckets[i] )
+            close_udp_flow( process, relay->buckets[i] );
+    }
+
+    unsigned long dgram_num = relay->up_num + relay->down_num;
+    LOG_INFO("worker %d, udp flows: %lu, expired: %lu, datagrams up: %lu, down: %lu, bytes up: %lu, down: %lu,"
+        " dropped: %lu", process->worker_id, relay->flow_total, relay->expire_num, relay->up_num, relay->down_num,
+        relay->up_byte_num, relay->down_byte_num, relay->drop_num );
+    LOG_INFO("worker %d, udp mode: %s, syscalls: %lu, per 1k datagrams: %lu, gro buffers: %lu, gso sends: %lu",
+        process->worker_id, g_udp_mode_names[relay->mode], relay->syscall_num,
+        dgram_num ? relay->syscall_num * 1000 / dgram_num : 0, relay->gro_num, relay->gso_num );
+
+    if( relay->listen.fd > 0 )
+        close( relay->listen.fd );
+    free( relay->buckets );
+    free( relay->bufs );
+    free( relay );
+    process->udp = NULL;
+}
@@ -0,0 +1,19 @@
+#ifndef UDP_H_
+#define UDP_H_
+
+#include "server.h"
+
+// udp relay of -u: datagrams of a client address are a flow, relayed through
+// a connected socket to the backend selected for it, in recvmmsg/sendmmsg
+// batches. a flow without datagrams for udp_idle_timeout is closed
+int init_udp_relay( worker_process_t *process );
+
+void destroy_udp_relay( worker_process_t *process );
+
+// UDP_MODE_* of plain, mmsg or gso, -1 when unknown
+int udp_mode_of_name( const char *name );
+
+// the flow is freed with the closed sessions
+void close_udp_flow( worker_process_t *process, session_t *session );
+
+#endif /*UDP_H_*/
@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+#include "upstream.h"
+#include "log.h"
+#include "utils.h"
+#include "sockopt.h"
+
+static void _fill_upstream( worker_process_t *process, upstream_t *upstream );
+
+static void _drop_upstream_connection( worker_process_t *process, connection_t *con )
+{
+    if( con->fd > 0 )
+        close( con->fd );
+    con->fd = 0;
+    free_connection_later( process, con );
+}
+
+// alive: no FIN or RST from the remote while idle, pending data is kept
+static int _upstream_connection_alive( connection_t *con )
+{
+    char c;
+    int ret = recv( con->fd, &c, 1, MSG_PEEK|MSG_DONTWAIT );
+    if( ret > 0 )
+        return 1;
+    return ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static void _upstream_idle_cb( worker_process_t *process, int fd, int events, void *arg )
+{
+    connection_t *con = (connection_t*)arg;
+    upstream_t *upstream = con->upstream;
+
+    if( _upstream_connection_alive( con ) )
+        return;
+
+    DEBUG_INFO("pooled connection closed by remote, fd:%d, %s:%d", fd, upstream->host.hostname, upstream->host.port );
+    list_del( &con->pool_node );
+    upstream->idle_num--;
+    _drop_upstream_connection( process, con );
+    _fill_upstream( process, upstream );
+}
+
+static void _upstream_connect_cb( worker_process_t *process, int fd, int events, void *arg )
+{
+    connection_t *con = (connection_t*)arg;
+    upstream_t *upstream = con->upstream;
+    int err = 0;
+    socklen_t len = sizeof(int);
+
+    upstream->connecting_num--;
+    if( getsockopt( fd, SOL_SOCKET, SO_ERROR, (void *)&err, &len ) < 0 )
+        err = errno;
+    if( err || (events & (EPOLLERR|EPOLLHUP)) ){
+        LOG_WARN("pool connect failed, %s:%d, %s", upstream->host.hostname, upstream->host.port, strerror(err) );
+        upstream->fail_stamp = get_sys_ms();
+        _drop_upstream_connection( process, con );
+        return;
+    }
+
+    // marked down or opened while connecting
+    if( upstream->down || upstream->circuit != CIRCUIT_CLOSED ){
+        _drop_upstream_connection( process, con );
+        return;
+    }
+
+    // edge triggered: a greeting from the remote wakes us up once, and stays in the socket
+    change_session_event( process->epoll_fd, con, fd, EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR|EPOLLET, _upstream_idle_cb );
+    list_add( &con->pool_node, &upstream->idle_head );
+    upstream->idle_num++;
+}
+
+int open_upstream_socket( worker_process_t *process, upstream_t *upstream )
+{
+    return open_upstream_socket_to( process, upstream, &upstream->addr );
+}
+
+static int _new_upstream_socket( worker_process_t *process, upstream_t *upstream )
+{
+    int fd = socket( AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0 );
+    if( fd < 0 ){
+        LOG_WARN("create remote socket error, %s:%d, %s", upstream->host.hostname, upstream->host.port, strerror(errno) );
+        return -1;
+    }
+
+    int value = process->config->reuseaddr ==1?1:0;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *) &value, sizeof(int)) == -1){
+        DEBUG_INFO("set SO_REUSEADDR fail, fd:%d", fd );
+    }
+    set_sock_profile( fd, upstream->sock_profile );
+    return fd;
+}
+
+int open_upstream_socket_to( worker_process_t *process, upstream_t *upstream, struct sockaddr_in *addr )
+{
+    int fd = _new_upstream_socket( process, upstream );
+    if( fd < 0 )
+        return -1;
+
+    if( connect( fd, (struct sockaddr*)addr, sizeof(struct sockaddr_in) ) < 0 && errno != EINPROGRESS ){
+        int err = errno;
+        DEBUG_INFO("connect remote error, fd:%d, %s:%d, %s", fd, upstream->host.hostname, upstream->host.port, strerror(err) );
+        close( fd );
+        errno = err;
+        return -1;
+    }
+
+    return fd;
+}
+
+int open_upstream_socket_with_data( worker_process_t *process, upstream_t *upstream, struct sockaddr_in *addr,
+    struct iovec *iov, int iovcnt, int *sent )
+{
+    *sent = 0;
+    int fd = _new_upstream_socket( process, upstream );
+    if( fd < 0 )
+        return -1;
+
+    // with a cookie of the remote the data is queued and goes in the SYN,
+    // without one a cookie request goes and the data waits for the relay
+    struct msghdr msg;
+    memset( &msg, 0, sizeof(msg) );
+    msg.msg_name = addr;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    int len = sendmsg( fd, &msg, MSG_FASTOPEN|MSG_NOSIGNAL );
+    if( len >= 0 ){
+        *sent = len;
+        return fd;
+    }
+    if( errno == EINPROGRESS )
+        return fd;
+
+    // fast open is off in net.ipv4.tcp_fastopen, nothing was sent
+    if( errno == EOPNOTSUPP ){
+        close( fd );
+        return open_upstream_socket_to( process, upstream, addr );
+    }
+
+    int err = errno;
+    DEBUG_INFO("fast open remote error, fd:%d, %s:%d, %s", fd, upstream->host.hostname, upstream->host.port, strerror(err) );
+    close( fd );
+    errno = err;
+    return -1;
+}
+
+// connect until idle + connecting reaches want_num
+static void _fill_upstream( worker_process_t *process, upstream_t *upstream )
+{
+    if( upstream->down || !upstream->resolved || upstream->circuit != CIRCUIT_CLOSED )
+        return;
+
+    while( upstream->idle_num + upstream->connecting_num < upstream->want_num ){
+        connection_t *con = (connection_t*)slab_alloc( &process->conn_pool );
+        if( con == NULL )
+            return;
+        memset( con, 0, sizeof(connection_t) );
+        con->upstream = upstream;
+        memcpy( &con->peer_host, &upstream->host, sizeof(host_t) );
+
+        con->fd = open_upstream_socket( process, upstream );
+        if( con->fd < 0 ){
+            upstream->fail_stamp = get_sys_ms();
+            slab_free( &process->conn_pool, con );
+            return;
+        }
+
+        register_session_event( process->epoll_fd, con, con->fd, EPOLLOUT|EPOLLHUP|EPOLLERR, _upstream_connect_cb );
+        upstream->connecting_num++;
+    }
+}
+
+// every period: size the pool by the sessions of the last one, and retry failed connects
+static void _upstream_timer_cb( timer_node_t *timer, void *arg )
+{
+    worker_process_t *process = (worker_process_t *)arg;
+    config_t *config = process->config;
+    upstream_t *upstream = list_entry( timer, upstream_t, timer );
+
+    upstream->want_num = upstream->take_num;
+    if( upstream->want_num < config->upstream_pool_min )
+        upstream->want_num = config->upstream_pool_min;
+    if( upstream->want_num > config->upstream_pool_max )
+        upstream->want_num = config->upstream_pool_max;
+    upstream->take_num = 0;
+
+    // shrink: the oldest idle ones go first
+    while( upstream->idle_num > upstream->want_num ){
+        connection_t *con = list_entry( upstream->idle_head.prev, connection_t, pool_node );
+        list_del( &con->pool_node );
+        upstream->idle_num--;
+        _drop_upstream_connection( process, con );
+    }
+
+    _fill_upstream( process, upstream );
+    timer_add( &process->timer_wheel, &upstream->timer, get_sys_ms() + UPSTREAM_REFILL_MS );
+}
+
+void drain_upstream_pool( worker_process_t *process, upstream_t *upstream )
+{
+    while( !list_empty( &upstream->idle_head ) ){
+        connection_t *con = list_entry( upstream->idle_head.next, connection_t, pool_node );
+        list_del( &con->pool_node );
+        upstream->idle_num--;
+        _drop_upstream_connection( process, con );
+    }
+}
+
+connection_t *take_upstream_connection( worker_process_t *process, upstream_t *upstream )
+{
+    connection_t *con = NULL;
+
+    upstream->take_num++;
+    while( !list_empty( &upstream->idle_head ) ){
+        con = list_entry( upstream->idle_head.next, connection_t, pool_node );
+        list_del( &con->pool_node );
+        upstream->idle_num--;
+        if( _upstream_connection_alive( con ) )
+            break;
+
+        DEBUG_INFO("pooled connection dead, fd:%d", con->fd );
+        _drop_upstream_connection( process, con );
+        con = NULL;
+    }
+
+    if( con )
+        upstream->hit++;
+    else
+        upstream->miss++;
+
+    // refill on use, unless the remote just failed
+    if( get_sys_ms() - upstream->fail_stamp >= UPSTREAM_REFILL_MS )
+        _fill_upstream( process, upstream );
+
+    return con;
+}
+
+static int _init_upstream( worker_process_t *process, upstream_t *upstream, backend_conf_t *backend )
+{
+    config_t *config = process->config;
+    INIT_LIST_HEAD( &upstream->idle_head );
+
+    struct sockaddr_in s_addr;
+    memset( &s_addr, 0, sizeof(struct sockaddr_in) );
+    s_addr.sin_family = AF_INET;
+    s_addr.sin_port = htons( backend->port );
+    upstream->addr = s_addr;
+    upstream->weight = backend->weight;
+    upstream->sock_profile = backend->sock_profile;
+
+    // a name is resolved by the resolver, not selected until then
+    if( inet_aton( backend->host, &upstream->addr.sin_addr ) == 0 ){
+        snprintf( (char *)upstream->host.hostname, HOST_NAME_LEN, "%s", backend->host );
+        upstream->host.port = backend->port;
+    }
+    else{
+        copy_sockaddr_to_host_t( &upstream->addr, &upstream->host );
+        upstream->resolved = 1;
+    }
+
+    // the pool needs epoll to watch the idle sockets
+    if( config->upstream_pool_max > 0 && process->epoll_fd > 0 ){
+        upstream->want_num = config->upstream_pool_min;
+        upstream->timer.handler = _upstream_timer_cb;
+        timer_add( &process->timer_wheel, &upstream->timer, get_sys_ms() + UPSTREAM_REFILL_MS );
+        _fill_upstream( process, upstream );
+    }
+
+    return 0;
+}
+
+int init_upstreams( worker_process_t *process )
+{
+    config_t *config = process->config;
+    int i;
+
+    process->upstreams = (upstream_t *)calloc( config->backend_num, sizeof(upstream_t) );
+    if( process->upstreams == NULL ){
+        LOG_ERROR("malloc upstreams error, num: %d", config->backend_num );
+        return -1;
+    }
+    process->upstream_num = config->backend_num;
+
+    for( i = 0; i < process->upstream_num; i++ ){
+        process->upstreams[i].index = i;
+        if( _init_upstream( process, &process->upstreams[i], &config->backends[i] ) < 0 )
+            return -1;
+    }
+
+    return 0;
+}
+
+void destroy_upstreams( worker_process_t *process )
+{
+    int i;
+    for( i = 0; i < process->upstream_num; i++ ){
+        upstream_t *upstream = &process->upstreams[i];
+
+        LOG_INFO("worker %d, upstream %s:%d selected: %lu, pool hit: %lu, miss: %lu, circuit opened: %lu, connect avg: %ld ms",
+            process->worker_id, upstream->host.hostname, upstream->host.port, upstream->select_num,
+            upstream->hit, upstream->miss, upstream->open_num, upstream->connect_ms );
+
+        drain_upstream_pool( process, upstream );
+        timer_del( &process->timer_wheel, &upstream->timer );
+    }
+
+    free( process->upstreams );
+    process->upstreams = NULL;
+    process->upstream_num = 0;
+}
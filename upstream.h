@@ -0,0 +1,28 @@
+#ifndef UPSTREAM_H_
+#define UPSTREAM_H_
+
+#include "server.h"
+
+// one upstream per config->backends
+int init_upstreams( worker_process_t *process );
+
+void destroy_upstreams( worker_process_t *process );
+
+// nonblocking socket with connect() started, -1 on error
+int open_upstream_socket( worker_process_t *process, upstream_t *upstream );
+
+// the same, to another address of the upstream
+int open_upstream_socket_to( worker_process_t *process, upstream_t *upstream, struct sockaddr_in *addr );
+
+// the same, sending iov in the SYN by tcp fast open. sent: the bytes queued,
+// 0 when the remote gave no cookie yet or fast open is off
+int open_upstream_socket_with_data( worker_process_t *process, upstream_t *upstream, struct sockaddr_in *addr,
+    struct iovec *iov, int iovcnt, int *sent );
+
+// a connected and alive socket from the pool, NULL when empty
+connection_t *take_upstream_connection( worker_process_t *process, upstream_t *upstream );
+
+// close the idle sockets of the pool
+void drain_upstream_pool( worker_process_t *process, upstream_t *upstream );
+
+#endif /*UPSTREAM_H_*/
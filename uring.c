@@ -0,0 +1,850 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+#include "log.h"
+#include "utils.h"
+#include "balance.h"
+#include "circuit.h"
+#include "sockopt.h"
+#include "stats.h"
+
+// user_data of a request: buffer id << 48 | connection_t pointer | op
+#define URING_OP_ACCEPT     0
+#define URING_OP_CONNECT    1
+#define URING_OP_RECV       2
+#define URING_OP_SEND       3
+#define URING_OP_CANCEL     4
+#define URING_OP_TIMEOUT    5       // linked to a connect, user_data is the client
+#define URING_OP_MASK       7ULL
+#define URING_PTR_MASK      0x0000fffffffffff8ULL
+
+#define URING_BUF_GROUP     0
+
+struct uring_s
+{
+    int fd;
+
+    // submission queue, sqe_tail is published to the kernel on enter
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_entries;
+    unsigned int sqe_tail;
+    struct io_uring_sqe *sqes;
+
+    // completion queue
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+
+    // provided buffers for recv, buffer id is the index in bufs
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_len;
+    unsigned short buf_ring_tail;
+    unsigned char *bufs;
+    int buf_free_num;
+    int *buf_next;              // next buffer id in a send queue, -1: end
+    unsigned int *buf_len;      // bytes recv into the buffer
+
+    list_node rearm_head;       // connections waiting for free buffers
+
+    struct __kernel_timespec connect_timeout;   // of every connect attempt, read on submit
+};
+
+static int _uring_setup( uring_t *uring, unsigned int entries )
+{
+    struct io_uring_params params;
+    memset( &params, 0, sizeof(params) );
+
+    uring->fd = syscall( __NR_io_uring_setup, entries, &params );
+    if( uring->fd < 0 ){
+        LOG_WARN("io_uring_setup failed, %s", strerror(errno) );
+        return -1;
+    }
+
+    if( !(params.features & IORING_FEAT_EXT_ARG) ){
+        LOG_WARN("io_uring has no IORING_FEAT_EXT_ARG, features: %x", params.features );
+        return -1;
+    }
+
+    uring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    uring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if( params.features & IORING_FEAT_SINGLE_MMAP ){
+        if( uring->cq_len > uring->sq_len )
+            uring->sq_len = uring->cq_len;
+        uring->cq_len = uring->sq_len;
+    }
+
+    uring->sq_ptr = mmap( NULL, uring->sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+        uring->fd, IORING_OFF_SQ_RING );
+    if( uring->sq_ptr == MAP_FAILED ){
+        DEBUG_INFO("mmap sq ring failed, %s", strerror(errno) );
+        return -1;
+    }
+
+    if( params.features & IORING_FEAT_SINGLE_MMAP )
+        uring->cq_ptr = uring->sq_ptr;
+    else{
+        uring->cq_ptr = mmap( NULL, uring->cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+            uring->fd, IORING_OFF_CQ_RING );
+        if( uring->cq_ptr == MAP_FAILED ){
+            DEBUG_INFO("mmap cq ring failed, %s", strerror(errno) );
+            return -1;
+        }
+    }
+
+    uring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap( NULL, uring->sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+        uring->fd, IORING_OFF_SQES );
+    if( uring->sqes == MAP_FAILED ){
+        DEBUG_INFO("mmap sqes failed, %s", strerror(errno) );
+        return -1;
+    }
+
+    uring->sq_head = (unsigned int *)((char *)uring->sq_ptr + params.sq_off.head);
+    uring->sq_tail = (unsigned int *)((char *)uring->sq_ptr + params.sq_off.tail);
+    uring->sq_mask = (unsigned int *)((char *)uring->sq_ptr + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned int *)((char *)uring->sq_ptr + params.sq_off.array);
+    uring->sq_entries = params.sq_entries;
+    uring->sqe_tail = *uring->sq_tail;
+
+    uring->cq_head = (unsigned int *)((char *)uring->cq_ptr + params.cq_off.head);
+    uring->cq_tail = (unsigned int *)((char *)uring->cq_ptr + params.cq_off.tail);
+    uring->cq_mask = (unsigned int *)((char *)uring->cq_ptr + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)((char *)uring->cq_ptr + params.cq_off.cqes);
+
+    return 0;
+}
+
+// publish the prepared sqes, and wait for at least wait_nr completions
+static int _uring_enter( uring_t *uring, unsigned int wait_nr, int timeout_ms )
+{
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    unsigned int flags = 0;
+    void *argp = NULL;
+    size_t argsz = 0;
+
+    __atomic_store_n( uring->sq_tail, uring->sqe_tail, __ATOMIC_RELEASE );
+    unsigned int to_submit = uring->sqe_tail - __atomic_load_n( uring->sq_head, __ATOMIC_ACQUIRE );
+
+    if( wait_nr > 0 ){
+        memset( &arg, 0, sizeof(arg) );
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        arg.ts = (unsigned long)&ts;
+        flags = IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
+    }
+
+    return syscall( __NR_io_uring_enter, uring->fd, to_submit, wait_nr, flags, argp, argsz );
+}
+
+static struct io_uring_sqe *_uring_get_sqe( uring_t *uring )
+{
+    // queue full, hand the prepared ones to the kernel first
+    if( uring->sqe_tail - __atomic_load_n( uring->sq_head, __ATOMIC_ACQUIRE ) >= uring->sq_entries ){
+        if( _uring_enter( uring, 0, 0 ) < 0 ){
+            LOG_ERROR("io_uring submit failed, %s", strerror(errno) );
+            return NULL;
+        }
+    }
+
+    unsigned int index = uring->sqe_tail & *uring->sq_mask;
+    struct io_uring_sqe *sqe = &uring->sqes[index];
+    memset( sqe, 0, sizeof(struct io_uring_sqe) );
+    uring->sq_array[index] = index;
+    uring->sqe_tail++;
+    return sqe;
+}
+
+// n sqes of a link go to the kernel in the same submit
+static int _uring_reserve( uring_t *uring, unsigned int n )
+{
+    if( uring->sqe_tail + n - __atomic_load_n( uring->sq_head, __ATOMIC_ACQUIRE ) > uring->sq_entries &&
+        _uring_enter( uring, 0, 0 ) < 0 ){
+        LOG_ERROR("io_uring submit failed, %s", strerror(errno) );
+        return -1;
+    }
+    return 0;
+}
+
+static unsigned long long _uring_data( connection_t *con, int op, int bid )
+{
+    return ((unsigned long long)(bid & 0xffff) << 48) | (unsigned long long)(unsigned long)con | op;
+}
+
+static unsigned char *_uring_buf( uring_t *uring, int bid )
+{
+    return uring->bufs + (size_t)bid * URING_BUF_SIZE;
+}
+
+// give a buffer back to the kernel for the next recv
+static void _uring_put_buf( uring_t *uring, int bid )
+{
+    struct io_uring_buf *buf = &uring->buf_ring->bufs[uring->buf_ring_tail & (URING_BUF_NUM-1)];
+    buf->addr = (unsigned long)_uring_buf( uring, bid );
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    uring->buf_ring_tail++;
+    __atomic_store_n( &uring->buf_ring->tail, uring->buf_ring_tail, __ATOMIC_RELEASE );
+    uring->buf_free_num++;
+}
+
+static int _uring_init_bufs( uring_t *uring )
+{
+    struct io_uring_buf_reg reg;
+    int bid;
+
+    uring->buf_ring_len = URING_BUF_NUM * sizeof(struct io_uring_buf);
+    uring->buf_ring = mmap( NULL, uring->buf_ring_len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0 );
+    if( uring->buf_ring == MAP_FAILED ){
+        DEBUG_INFO("mmap buffer ring failed, %s", strerror(errno) );
+        uring->buf_ring = NULL;
+        return -1;
+    }
+
+    memset( &reg, 0, sizeof(reg) );
+    reg.ring_addr = (unsigned long)uring->buf_ring;
+    reg.ring_entries = URING_BUF_NUM;
+    reg.bgid = URING_BUF_GROUP;
+    if( syscall( __NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0 ){
+        LOG_WARN("register buffer ring failed, %s", strerror(errno) );
+        return -1;
+    }
+
+    uring->bufs = (unsigned char *)malloc( (size_t)URING_BUF_NUM * URING_BUF_SIZE );
+    uring->buf_next = (int *)malloc( URING_BUF_NUM * sizeof(int) );
+    uring->buf_len = (unsigned int *)malloc( URING_BUF_NUM * sizeof(unsigned int) );
+    if( uring->bufs == NULL || uring->buf_next == NULL || uring->buf_len == NULL ){
+        DEBUG_INFO("malloc provided buffers failed");
+        return -1;
+    }
+
+    uring->buf_ring_tail = 0;
+    for( bid = 0; bid < URING_BUF_NUM; bid++ )
+        _uring_put_buf( uring, bid );
+
+    return 0;
+}
+
+static void _uring_arm_accept( worker_process_t *process )
+{
+    struct io_uring_sqe *sqe = _uring_get_sqe( process->uring );
+    if( sqe == NULL )
+        return;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = process->listen_fd;
+    sqe->accept_flags = SOCK_NONBLOCK|SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = _uring_data( NULL, URING_OP_ACCEPT, 0 );
+}
+
+static void _uring_arm_recv( worker_process_t *process, connection_t *con )
+{
+    if( con->recv_armed || con->eof || con->session->closed )
+        return;
+
+    struct io_uring_sqe *sqe = _uring_get_sqe( process->uring );
+    if( sqe == NULL )
+        return;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = con->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = _uring_data( con, URING_OP_RECV, 0 );
+
+    con->recv_armed = 1;
+    con->session->uring_refs++;
+}
+
+// send the queued buffers of con to its peer as one linked chain: a chain runs
+// in order, and a new chain is started only when the previous one completed
+static void _uring_flush_send( worker_process_t *process, connection_t *con )
+{
+    uring_t *uring = process->uring;
+    connection_t *peer = con->peer_conn;
+
+    if( con->send_inflight > 0 || con->send_head < 0 )
+        return;
+
+    while( con->send_head >= 0 ){
+        int bid = con->send_head;
+        struct io_uring_sqe *sqe = _uring_get_sqe( uring );
+        if( sqe == NULL )
+            return;
+
+        con->send_head = uring->buf_next[bid];
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = peer->fd;
+        sqe->addr = (unsigned long)_uring_buf( uring, bid );
+        sqe->len = uring->buf_len[bid];
+        sqe->msg_flags = MSG_WAITALL|MSG_NOSIGNAL;
+        if( con->send_head >= 0 )
+            sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = _uring_data( con, URING_OP_SEND, bid );
+
+        con->send_inflight++;
+        con->session->uring_refs++;
+        con->syscall_num++;
+    }
+    con->send_tail = -1;
+}
+
+static void _uring_cancel( worker_process_t *process, connection_t *con )
+{
+    if( con->fd <= 0 )
+        return;
+
+    struct io_uring_sqe *sqe = _uring_get_sqe( process->uring );
+    if( sqe == NULL )
+        return;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = con->fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD|IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = _uring_data( con, URING_OP_CANCEL, 0 );
+    con->session->uring_refs++;
+}
+
+static void _uring_release_connection( worker_process_t *process, connection_t *con )
+{
+    uring_t *uring = process->uring;
+
+    while( con->send_head >= 0 ){
+        int bid = con->send_head;
+        con->send_head = uring->buf_next[bid];
+        _uring_put_buf( uring, bid );
+    }
+
+    if( con->uring_node.next != NULL )
+        list_del( &con->uring_node );
+
+    if( con->fd > 0 )
+        close( con->fd );
+    con->fd = 0;
+
+    process->byte_num += con->byte_num;
+    process->syscall_num += con->syscall_num;
+    slab_free( &process->conn_pool, con );
+}
+
+// memory of a closed session is kept until its last request completed
+static void _uring_put_session( worker_process_t *process, session_t *session )
+{
+    if( !session->closed || session->uring_refs > 0 )
+        return;
+
+    if( session->remote )
+        _uring_release_connection( process, session->remote );
+    _uring_release_connection( process, session->client );
+    slab_free( &process->session_pool, session );
+}
+
+static void _uring_close_session( worker_process_t *process, session_t *session )
+{
+    if( session->closed )
+        return;
+
+    session->closed = 1;
+    session->closed_by = CLOSE_BY_SOCKD;
+    if( session->client->eof )
+        session->closed_by = CLOSE_BY_CLIENT;
+    if( session->remote && session->remote->eof )
+        session->closed_by = CLOSE_BY_REMOTE;
+
+    process->session_num--;
+    STATS_ADD( process, session_num, -1 );
+    STATS_ADD( process, close_num[session->closed_by], 1 );
+    record_latency( process, STATS_HIST_SESSION, session->connect_us );
+    list_del( &session->list_node );
+    timer_del( &process->timer_wheel, &session->timer );
+    session->close_stamp = get_sys_ms();
+    DEBUG_INFO("session closed, client fd:%d, closed by: %d, sessions: %d",
+        session->client->fd, session->closed_by, process->session_num );
+
+    _uring_cancel( process, session->client );
+    if( session->remote )
+        _uring_cancel( process, session->remote );
+    if( session->remote && session->remote->upstream ){
+        circuit_connect_abort( process, session->remote );
+        release_upstream( process, session->remote->upstream );
+    }
+}
+
+// one attempt at a time, each with a linked timeout
+static void _uring_connect_remote( worker_process_t *process, session_t *session )
+{
+    uring_t *uring = process->uring;
+    connection_t *client = session->client;
+    struct sockaddr_in addr;
+    session->stage = SERVER_CONNECT_REMOTE;
+
+    upstream_t *upstream = select_next_upstream( process, session, &addr );
+    if( upstream == NULL ){
+        LOG_WARN("no backend available, fd:%d", client->fd );
+        _uring_close_session( process, session );
+        return;
+    }
+
+    connection_t *remote = (connection_t*)slab_alloc( &process->conn_pool );
+    if( remote == NULL ){
+        DEBUG_INFO("malloc remote connection error, fd:%d", client->fd );
+        release_upstream( process, upstream );
+        _uring_close_session( process, session );
+        return;
+    }
+    memset( remote, 0, sizeof(connection_t) );
+    remote->send_head = remote->send_tail = -1;
+    remote->session = session;
+    remote->upstream = upstream;
+    session->remote = remote;
+    client->peer_conn = remote;
+    remote->peer_conn = client;
+    copy_sockaddr_to_host_t( &addr, &remote->peer_host );
+    remote->connect_stamp = get_sys_ms();
+    session->attempt_total++;
+    process->connect_attempt_num++;
+
+    remote->fd = socket( AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0 );
+    if( remote->fd < 0 ){
+        DEBUG_INFO("create remote socket error, %s:%d", remote->peer_host.hostname, remote->peer_host.port );
+        remote->fd = 0;
+        _uring_close_session( process, session );
+        return;
+    }
+    set_sock_profile( remote->fd, upstream->sock_profile );
+
+    if( _uring_reserve( uring, 2 ) < 0 ){
+        _uring_close_session( process, session );
+        return;
+    }
+    circuit_connect_start( process, remote );
+
+    // peer_host.ipv4 stays valid until the connect completes
+    struct io_uring_sqe *sqe = _uring_get_sqe( uring );
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = remote->fd;
+    sqe->addr = (unsigned long)&remote->peer_host.ipv4;
+    sqe->off = sizeof(struct sockaddr_in);
+    sqe->user_data = _uring_data( remote, URING_OP_CONNECT, 0 );
+
+    // the remote may be gone for the next attempt when the timeout completes
+    sqe = _uring_get_sqe( uring );
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (unsigned long)&uring->connect_timeout;
+    sqe->len = 1;
+    sqe->user_data = _uring_data( client, URING_OP_TIMEOUT, 0 );
+    session->uring_refs += 2;
+}
+
+static void _uring_accept_cb( worker_process_t *process, struct io_uring_cqe *cqe )
+{
+    if( !(cqe->flags & IORING_CQE_F_MORE) )
+        _uring_arm_accept( process );
+
+    if( cqe->res < 0 ){
+        LOG_WARN("accept error, listen_fd:%d, %s", process->listen_fd, strerror(-cqe->res) );
+        return;
+    }
+
+    int fd = cqe->res;
+    session_t *session = create_session( process, fd );
+    if( session == NULL ){
+        DEBUG_INFO("no memory,fd: %d", fd );
+        close( fd );
+        return;
+    }
+
+    process->session_num++;
+    STATS_ADD( process, accept_num, 1 );
+    STATS_ADD( process, session_num, 1 );
+    list_add_tail( &session->list_node, &process->session_list_head );
+    set_sock_profile( fd, process->config->client_sock_profile );
+    session->client->send_head = session->client->send_tail = -1;
+    session->connect_stamp = get_sys_ms();
+    session->connect_us = get_current_us();
+    DEBUG_INFO("new connection, fd:%d, sessions: %d", fd, process->session_num );
+
+    _uring_connect_remote( process, session );
+}
+
+static void _uring_connect_cb( worker_process_t *process, connection_t *remote, struct io_uring_cqe *cqe )
+{
+    session_t *session = remote->session;
+    session->uring_refs--;
+
+    if( session->closed ){
+        _uring_put_session( process, session );
+        return;
+    }
+
+    if( cqe->res < 0 ){
+        // canceled by its linked timeout
+        int err = cqe->res == -ECANCELED ? ETIMEDOUT : -cqe->res;
+        DEBUG_INFO("connect remote error, fd:%d, %s:%d, %s", remote->fd, remote->peer_host.hostname,
+            remote->peer_host.port, strerror(err) );
+        session->err = err;
+        process->connect_fail_num++;
+        STATS_ADD( process, connect_fail_num, 1 );
+        if( err == ETIMEDOUT )
+            process->connect_timeout_num++;
+        circuit_connect_done( process, remote, err );
+
+        if( session->attempt_total <= process->config->connect_retries ){
+            release_upstream( process, remote->upstream );
+            session->remote = NULL;
+            _uring_release_connection( process, remote );
+            _uring_connect_remote( process, session );
+            return;
+        }
+        _uring_close_session( process, session );
+        _uring_put_session( process, session );
+        return;
+    }
+
+    DEBUG_INFO("connect remote ok, fd:%d", remote->fd );
+    circuit_connect_done( process, remote, 0 );
+    count_connect( process, session );
+    session->stage = SERVER_DATA;
+    session->last_data_stamp = get_sys_ms();
+    _uring_arm_recv( process, session->client );
+    _uring_arm_recv( process, remote );
+}
+
+static void _uring_recv_cb( worker_process_t *process, connection_t *con, struct io_uring_cqe *cqe )
+{
+    uring_t *uring = process->uring;
+    session_t *session = con->session;
+    int bid = -1;
+
+    if( !(cqe->flags & IORING_CQE_F_MORE) ){
+        con->recv_armed = 0;
+        session->uring_refs--;
+    }
+
+    if( cqe->flags & IORING_CQE_F_BUFFER ){
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        uring->buf_free_num--;
+    }
+
+    if( session->closed ){
+        if( bid >= 0 )
+            _uring_put_buf( uring, bid );
+        _uring_put_session( process, session );
+        return;
+    }
+
+    if( cqe->res > 0 && bid >= 0 ){
+        session->last_data_stamp = get_sys_ms();
+        con->byte_num += cqe->res;
+        if( con == session->client )
+            STATS_ADD( process, up_byte_num, cqe->res );
+        else{
+            STATS_ADD( process, down_byte_num, cqe->res );
+            if( !session->replied ){
+                session->replied = 1;
+                record_latency( process, STATS_HIST_FIRST_BYTE, session->connect_us );
+            }
+        }
+        uring->buf_len[bid] = cqe->res;
+        uring->buf_next[bid] = -1;
+        if( con->send_tail >= 0 )
+            uring->buf_next[con->send_tail] = bid;
+        else
+            con->send_head = bid;
+        con->send_tail = bid;
+
+        _uring_flush_send( process, con );
+        if( !con->recv_armed )
+            _uring_arm_recv( process, con );
+        return;
+    }
+
+    if( cqe->res == 0 ){
+        // eof, the session is closed once the data of this direction is sent
+        DEBUG_INFO("recv eof, fd:%d", con->fd );
+        con->eof = 1;
+        if( con->send_head < 0 && con->send_inflight == 0 ){
+            _uring_close_session( process, session );
+            _uring_put_session( process, session );
+        }
+        return;
+    }
+
+    if( cqe->res == -ENOBUFS ){
+        // all buffers are waiting to be sent, retry when some come back
+        if( con->uring_node.next == NULL )
+            list_add_tail( &con->uring_node, &uring->rearm_head );
+        return;
+    }
+
+    DEBUG_INFO("recv error, fd:%d, %s", con->fd, strerror(-cqe->res) );
+    session->err = -cqe->res;
+    _uring_close_session( process, session );
+    _uring_put_session( process, session );
+}
+
+static void _uring_send_cb( worker_process_t *process, connection_t *con, struct io_uring_cqe *cqe )
+{
+    uring_t *uring = process->uring;
+    session_t *session = con->session;
+    int bid = (int)(cqe->user_data >> 48);
+    unsigned int len = uring->buf_len[bid];
+
+    session->uring_refs--;
+    con->send_inflight--;
+    _uring_put_buf( uring, bid );
+
+    if( session->closed ){
+        _uring_put_session( process, session );
+        return;
+    }
+
+    // MSG_WAITALL: anything short of the whole buffer is an error
+    if( cqe->res < 0 || (unsigned int)cqe->res < len ){
+        DEBUG_INFO("send error, fd:%d, len:%u, %s", con->peer_conn->fd, len,
+            cqe->res < 0 ? strerror(-cqe->res) : "short send" );
+        if( cqe->res == -EPIPE || cqe->res == -ECONNRESET )
+            con->peer_conn->eof = 1;
+        session->err = cqe->res < 0 ? -cqe->res : 0;
+        _uring_close_session( process, session );
+        _uring_put_session( process, session );
+        return;
+    }
+
+    session->last_data_stamp = get_sys_ms();
+    if( con->send_inflight > 0 )
+        return;
+
+    _uring_flush_send( process, con );
+    if( con->eof && con->send_head < 0 && con->send_inflight == 0 )
+        _uring_close_session( process, session );
+}
+
+static void _uring_handle_cqe( worker_process_t *process, struct io_uring_cqe *cqe )
+{
+    connection_t *con = (connection_t *)(unsigned long)(cqe->user_data & URING_PTR_MASK);
+
+    switch( cqe->user_data & URING_OP_MASK ){
+        case URING_OP_ACCEPT:
+            _uring_accept_cb( process, cqe );
+            break;
+        case URING_OP_CONNECT:
+            _uring_connect_cb( process, con, cqe );
+            break;
+        case URING_OP_RECV:
+            _uring_recv_cb( process, con, cqe );
+            break;
+        case URING_OP_SEND:
+            _uring_send_cb( process, con, cqe );
+            break;
+        case URING_OP_CANCEL:
+        case URING_OP_TIMEOUT:
+            con->session->uring_refs--;
+            _uring_put_session( process, con->session );
+            break;
+    }
+}
+
+// re-arm the recvs stopped by ENOBUFS, once buffers were given back
+static void _uring_rearm_recv( worker_process_t *process )
+{
+    uring_t *uring = process->uring;
+
+    while( uring->buf_free_num > 0 && !list_empty( &uring->rearm_head ) ){
+        connection_t *con = list_entry( uring->rearm_head.next, connection_t, uring_node );
+        list_del( &con->uring_node );
+        _uring_arm_recv( process, con );
+    }
+}
+
+// every opcode submitted, supported by the kernel
+static int _uring_probe_ops( uring_t *uring )
+{
+    static const int ops[] = { IORING_OP_ACCEPT, IORING_OP_CONNECT, IORING_OP_RECV, IORING_OP_SEND,
+        IORING_OP_ASYNC_CANCEL, IORING_OP_LINK_TIMEOUT };
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc( 1, len );
+    int i, ret = 0;
+
+    if( probe == NULL )
+        return -1;
+    if( syscall( __NR_io_uring_register, uring->fd, IORING_REGISTER_PROBE, probe, 256 ) < 0 ){
+        LOG_WARN("io_uring probe failed, %s", strerror(errno) );
+        free( probe );
+        return -1;
+    }
+    for( i = 0; i < sizeof(ops) / sizeof(ops[0]); i++ ){
+        if( ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) ){
+            LOG_WARN("io_uring has no opcode %d", ops[i] );
+            ret = -1;
+        }
+    }
+    free( probe );
+    return ret;
+}
+
+// the next completion, within timeout_ms
+static int _uring_wait_cqe( uring_t *uring, struct io_uring_cqe *cqe, int timeout_ms )
+{
+    unsigned int head = *uring->cq_head;
+
+    if( head == __atomic_load_n( uring->cq_tail, __ATOMIC_ACQUIRE ) &&
+        (_uring_enter( uring, 1, timeout_ms ) < 0 || head == __atomic_load_n( uring->cq_tail, __ATOMIC_ACQUIRE )) )
+        return -1;
+    *cqe = uring->cqes[head & *uring->cq_mask];
+    __atomic_store_n( uring->cq_head, head + 1, __ATOMIC_RELEASE );
+    return 0;
+}
+
+// the flags the ring takes for granted, which the opcodes probe does not show:
+// a multishot recv of one byte on a socketpair. IORING_RECV_MULTISHOT (6.0) came
+// after IORING_ACCEPT_MULTISHOT (5.19), a kernel with it has both
+static int _uring_probe_multishot( uring_t *uring )
+{
+    struct io_uring_cqe cqe;
+    int sv[2], ret = -1;
+
+    if( socketpair( AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0, sv ) < 0 )
+        return -1;
+    struct io_uring_sqe *sqe = _uring_get_sqe( uring );
+    if( sqe == NULL || write( sv[1], "x", 1 ) != 1 )
+        goto out;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sv[0];
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+
+    if( _uring_wait_cqe( uring, &cqe, 1000 ) < 0 )
+        goto out;
+    if( cqe.flags & IORING_CQE_F_BUFFER ){
+        uring->buf_free_num--;
+        _uring_put_buf( uring, cqe.flags >> IORING_CQE_BUFFER_SHIFT );
+    }
+    if( cqe.res != 1 || !(cqe.flags & IORING_CQE_F_MORE) ){
+        LOG_WARN("io_uring has no multishot recv, %s", cqe.res < 0 ? strerror(-cqe.res) : "single shot" );
+        goto out;
+    }
+
+    // eof ends the multishot recv
+    shutdown( sv[1], SHUT_WR );
+    if( _uring_wait_cqe( uring, &cqe, 1000 ) == 0 && !(cqe.flags & IORING_CQE_F_MORE) )
+        ret = 0;
+out:
+    close( sv[0] );
+    close( sv[1] );
+    return ret;
+}
+
+static void _uring_backend_done( worker_process_t *process );
+
+static void _uring_backend_close( worker_process_t *process, session_t *session )
+{
+    _uring_close_session( process, session );
+    _uring_put_session( process, session );
+}
+
+static int _uring_backend_init( worker_process_t *process )
+{
+    uring_t *uring = (uring_t *)malloc( sizeof(uring_t) );
+    if( uring == NULL )
+        return -1;
+    memset( uring, 0, sizeof(uring_t) );
+    uring->fd = -1;
+    INIT_LIST_HEAD( &uring->rearm_head );
+    uring->connect_timeout.tv_sec = process->config->connect_attempt_ms / 1000;
+    uring->connect_timeout.tv_nsec = (process->config->connect_attempt_ms % 1000) * 1000000L;
+    process->uring = uring;
+
+    // -1 on any of them falls back to epoll, not a failure per request later
+    if( _uring_setup( uring, URING_ENTRIES ) < 0 || _uring_probe_ops( uring ) < 0 ||
+        _uring_init_bufs( uring ) < 0 || _uring_probe_multishot( uring ) < 0 ){
+        _uring_backend_done( process );
+        return -1;
+    }
+
+    _uring_arm_accept( process );
+    return 0;
+}
+
+static int _uring_backend_run( worker_process_t *process )
+{
+    uring_t *uring = process->uring;
+
+    // no callback breakdown, the completions are not of the epoll callbacks
+    while( !g_worker_exiting ){
+        int timeout = timer_next_timeout( &process->timer_wheel, get_sys_ms(), 1000 );
+        unsigned long wait_start = stats_ticks();
+        if( _uring_enter( uring, 1, timeout ) < 0 && errno != ETIME && errno != EINTR && errno != EBUSY ){
+            LOG_ERROR("io_uring_enter exit, %s", strerror(errno) );
+            return -1;
+        }
+        unsigned long busy_start = stats_ticks();
+        STATS_ADD( process, wait_ticks, busy_start - wait_start );
+        update_sys_ms();
+
+        unsigned int head = *uring->cq_head;
+        unsigned int tail = __atomic_load_n( uring->cq_tail, __ATOMIC_ACQUIRE );
+        hist_record( &process->stats->batch_hist, tail - head );
+        while( head != tail ){
+            _uring_handle_cqe( process, &uring->cqes[head & *uring->cq_mask] );
+            head++;
+        }
+        __atomic_store_n( uring->cq_head, head, __ATOMIC_RELEASE );
+
+        _uring_rearm_recv( process );
+        timer_expire( &process->timer_wheel, get_sys_ms(), process );
+        STATS_ADD( process, busy_ticks, stats_ticks() - busy_start );
+    }
+
+    return 0;
+}
+
+static void _uring_backend_done( worker_process_t *process )
+{
+    uring_t *uring = process->uring;
+    if( uring == NULL )
+        return;
+
+    if( uring->buf_ring )
+        munmap( uring->buf_ring, uring->buf_ring_len );
+    if( uring->sqes && uring->sqes != MAP_FAILED )
+        munmap( uring->sqes, uring->sqes_len );
+    if( uring->cq_ptr && uring->cq_ptr != MAP_FAILED && uring->cq_ptr != uring->sq_ptr )
+        munmap( uring->cq_ptr, uring->cq_len );
+    if( uring->sq_ptr && uring->sq_ptr != MAP_FAILED )
+        munmap( uring->sq_ptr, uring->sq_len );
+    if( uring->fd >= 0 )
+        close( uring->fd );
+
+    free( uring->bufs );
+    free( uring->buf_next );
+    free( uring->buf_len );
+    free( uring );
+    process->uring = NULL;
+}
+
+event_backend_t uring_backend = {
+    "io_uring",
+    _uring_backend_init,
+    _uring_backend_run,
+    _uring_backend_done,
+    _uring_backend_close
+};
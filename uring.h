@@ -0,0 +1,10 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include "server.h"
+
+// io_uring event backend: multishot accept, multishot recv into provided
+// buffers, and linked sends to keep the order of the buffers of a direction
+extern event_backend_t uring_backend;
+
+#endif /*URING_H_*/
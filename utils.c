@@ -9,6 +9,13 @@ long get_current_ms()
     return ((long)tv.tv_sec)*1000+((long)tv.tv_usec)/1000;
 }
 
+long get_current_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000L + ts.tv_nsec/1000;
+}
+
 long get_sys_ms()
 {
     return g_sys_ms;
@@ -22,10 +29,22 @@ void update_sys_ms()
 
 void copy_sockaddr_to_host_t ( struct sockaddr_in *s_addr, host_t *host )
 {
-    unsigned char * hostname = inet_ntoa(s_addr->sin_addr);
-    size_t host_len = strlen(hostname);
-    strncpy( host->hostname, hostname, host_len );
+    snprintf( (char *)host->hostname, HOST_NAME_LEN, "%s", inet_ntoa(s_addr->sin_addr) );
     host->port = ntohs(s_addr->sin_port);
     memcpy(&host->ipv4, s_addr, sizeof(struct sockaddr_in));
     return;
-}
\ No newline at end of file
+}
+
+// local address of a connection, getsockname() on first use only
+host_t *get_local_host( connection_t *con )
+{
+    if( !con->local_resolved && con->fd > 0 ){
+        struct sockaddr_in local_addr; 
+        socklen_t len = sizeof(local_addr);
+        if( getsockname( con->fd, (struct sockaddr*)&local_addr, &len) == 0 ){
+            copy_sockaddr_to_host_t( &local_addr, &con->local_host );
+            con->local_resolved = 1;
+        }
+    }
+    return &con->local_host;
+}
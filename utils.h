@@ -7,10 +7,15 @@ static long g_sys_ms = 0;
 
 long get_current_ms();
 
+// monotonic, for latencies below the ms of the cached clock
+long get_current_us();
+
 long get_sys_ms();
 
 void update_sys_ms();
 
 void copy_sockaddr_to_host_t ( struct sockaddr_in *s_addr, host_t *host );
 
+host_t *get_local_host( connection_t *con );
+
 #endif /*UTILS_H_*/
\ No newline at end of file